@@ -0,0 +1,703 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT License.
+
+// Latency benchmarks for resolution, including pathological inputs that must
+// be rejected in bounded time by the default Limits. Each scenario also
+// reports heap allocations (C++ and OpenSSL) and, where the kernel allows
+// it, user-space instructions per iteration.
+//
+// The cold-start rows time the first resolution in a fresh process, with
+// and without a preceding warmup(); each sample is a separate child process.
+//
+// Usage: didx509_bench [--filter SUBSTRING]
+
+#include "didx509cpp.h"
+
+#include "certgen.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <new>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#if defined(__linux__)
+#  include <linux/perf_event.h>
+#  include <sys/ioctl.h>
+#  include <sys/syscall.h>
+#  include <unistd.h>
+#endif
+
+using namespace didx509;
+
+namespace
+{
+  std::atomic<size_t> allocations{0};
+
+  void* counting_malloc(size_t n, const char*, int)
+  {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    return std::malloc(n);
+  }
+
+  void* counting_realloc(void* p, size_t n, const char*, int)
+  {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    return std::realloc(p, n);
+  }
+
+  void counting_free(void* p, const char*, int)
+  {
+    std::free(p);
+  }
+}
+
+void* operator new(size_t n)
+{
+  allocations.fetch_add(1, std::memory_order_relaxed);
+  if (void* p = std::malloc(n == 0 ? 1 : n))
+  {
+    return p;
+  }
+  throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept
+{
+  std::free(p);
+}
+
+void operator delete(void* p, size_t) noexcept
+{
+  std::free(p);
+}
+
+namespace
+{
+  // Counts user-space instructions retired by this thread, if the kernel
+  // lets us open a hardware counter.
+  class InstructionCounter
+  {
+  public:
+    InstructionCounter()
+    {
+#if defined(__linux__)
+      perf_event_attr attr{};
+      attr.type = PERF_TYPE_HARDWARE;
+      attr.size = sizeof(attr);
+      attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+      attr.exclude_kernel = 1;
+      attr.exclude_hv = 1;
+      fd = static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+#endif
+    }
+
+    ~InstructionCounter()
+    {
+#if defined(__linux__)
+      if (fd >= 0)
+      {
+        close(fd);
+      }
+#endif
+    }
+
+    InstructionCounter(const InstructionCounter&) = delete;
+    InstructionCounter& operator=(const InstructionCounter&) = delete;
+
+    [[nodiscard]] bool available() const
+    {
+      return fd >= 0;
+    }
+
+    [[nodiscard]] uint64_t read() const
+    {
+      uint64_t value = 0;
+#if defined(__linux__)
+      if (fd >= 0 && ::read(fd, &value, sizeof(value)) != sizeof(value))
+      {
+        value = 0;
+      }
+#endif
+      return value;
+    }
+
+  private:
+    int fd = -1;
+  };
+
+  struct Scenario
+  {
+    std::string name;
+    std::function<void(const Limits&)> run;
+  };
+
+  struct Result
+  {
+    double median_us = 0;
+    double max_us = 0;
+    size_t iterations = 0;
+    double allocations = 0;
+    std::optional<double> instructions;
+    std::string outcome;
+  };
+
+  // Runs `f` repeatedly for about `budget`, at least once and at most
+  // `max_iterations` times.
+  Result measure(
+    const std::function<void()>& f,
+    std::chrono::milliseconds budget = std::chrono::milliseconds(300),
+    size_t max_iterations = 10000)
+  {
+    using clock = std::chrono::steady_clock;
+    static const InstructionCounter instructions;
+    std::vector<double> samples;
+    Result r;
+    const auto allocations_before = allocations.load();
+    const auto instructions_before = instructions.read();
+    const auto start = clock::now();
+    do
+    {
+      const auto t0 = clock::now();
+      try
+      {
+        f();
+        r.outcome = "ok";
+      }
+      catch (const std::exception& e)
+      {
+        r.outcome = e.what();
+      }
+      samples.push_back(
+        std::chrono::duration<double, std::micro>(clock::now() - t0).count());
+    } while (clock::now() - start < budget && samples.size() < max_iterations);
+    const auto n = static_cast<double>(samples.size());
+    r.allocations = static_cast<double>(allocations - allocations_before) / n;
+    if (instructions.available())
+    {
+      r.instructions =
+        static_cast<double>(instructions.read() - instructions_before) / n;
+    }
+
+    std::sort(samples.begin(), samples.end());
+    r.median_us = samples[samples.size() / 2];
+    r.max_us = samples.back();
+    r.iterations = samples.size();
+    if (r.outcome.size() > 48)
+    {
+      r.outcome = r.outcome.substr(0, 45) + "...";
+    }
+    return r;
+  }
+
+  void report(
+    const std::string& name, const std::string& limits, const Result& r)
+  {
+    std::cout << std::left << std::setw(28) << name << std::setw(11) << limits
+              << std::right << std::setw(12) << std::fixed
+              << std::setprecision(1) << r.median_us << std::setw(12)
+              << r.max_us << std::setw(8) << r.iterations << std::setw(10)
+              << std::setprecision(0) << r.allocations << std::setw(12);
+    if (r.instructions)
+    {
+      std::cout << *r.instructions;
+    }
+    else
+    {
+      std::cout << "-";
+    }
+    std::cout << "  " << r.outcome << "\n";
+  }
+
+#if defined(__linux__)
+  // Child side of the cold-start rows: resolves the chain in `path` (DID on
+  // the first line, PEM after it) once, after warmup() if `mode` is "warm",
+  // and prints the warm-up time, first resolution time and the allocations
+  // made by the first resolution.
+  int cold_start_child(const std::string& mode, const std::string& path)
+  {
+    using clock = std::chrono::steady_clock;
+    std::ifstream f(path, std::ios::binary);
+    std::string did;
+    std::getline(f, did);
+    const std::string pem(std::istreambuf_iterator<char>(f), {});
+
+    double warmup_us = 0;
+    if (mode == "warm")
+    {
+      const auto t0 = clock::now();
+      warmup();
+      warmup_us =
+        std::chrono::duration<double, std::micro>(clock::now() - t0).count();
+    }
+    const auto allocations_before = allocations.load();
+    const auto t0 = clock::now();
+    try
+    {
+      resolve(pem, did);
+    }
+    catch (const std::exception& e)
+    {
+      std::cerr << e.what() << "\n";
+      return 1;
+    }
+    const auto first_us =
+      std::chrono::duration<double, std::micro>(clock::now() - t0).count();
+    std::cout << warmup_us << " " << first_us << " "
+              << allocations - allocations_before << "\n";
+    return 0;
+  }
+
+  // Runs `runs` children in `mode` and reports the first resolution time, and
+  // for "warm" also the warm-up time itself.
+  void cold_start(const std::string& filter, size_t runs = 10)
+  {
+    auto chain = certgen::make_chain(
+      {"bench leaf",
+       false,
+       {{"O", "didx509cpp"}},
+       "DNS:leaf.example",
+       "1.3.6.1.5.5.7.3.3"},
+      1);
+    const auto did = certgen::did_prefix(chain.back()) +
+      "::subject:CN:bench%20leaf::eku:1.3.6.1.5.5.7.3.3";
+    const auto path =
+      (std::filesystem::temp_directory_path() / "didx509-bench-cold.txt")
+        .string();
+    std::ofstream(path, std::ios::binary)
+      << did << "\n"
+      << certgen::to_pem(chain);
+    const auto self = std::filesystem::read_symlink("/proc/self/exe").string();
+
+    for (const std::string mode : {"cold", "warm"})
+    {
+      const std::string name =
+        mode == "cold" ? "cold-start" : "cold-start-warmed";
+      if (name.find(filter) == std::string::npos)
+      {
+        continue;
+      }
+      std::vector<double> warmup_samples;
+      std::vector<double> first_samples;
+      double total_allocations = 0;
+      std::string outcome = "ok";
+      for (size_t i = 0; i < runs; i++)
+      {
+        const auto command =
+          "'" + self + "' --cold-child " + mode + " '" + path + "'";
+        FILE* child = popen(command.c_str(), "r");
+        std::string out;
+        char buf[256];
+        while (child != nullptr && fgets(buf, sizeof(buf), child) != nullptr)
+        {
+          out += buf;
+        }
+        double warmup_us = 0;
+        double first_us = 0;
+        double child_allocations = 0;
+        if (
+          child == nullptr || pclose(child) != 0 ||
+          !(std::istringstream(out) >> warmup_us >> first_us >>
+            child_allocations))
+        {
+          outcome = "child failed";
+          break;
+        }
+        warmup_samples.push_back(warmup_us);
+        first_samples.push_back(first_us);
+        total_allocations += child_allocations;
+      }
+
+      const auto summarise = [&](std::vector<double>& samples) {
+        Result r;
+        r.outcome = outcome;
+        if (samples.empty())
+        {
+          return r;
+        }
+        std::sort(samples.begin(), samples.end());
+        r.median_us = samples[samples.size() / 2];
+        r.max_us = samples.back();
+        r.iterations = samples.size();
+        r.allocations =
+          total_allocations / static_cast<double>(samples.size());
+        return r;
+      };
+      report(name, "default", summarise(first_samples));
+      if (mode == "warm")
+      {
+        auto r = summarise(warmup_samples);
+        r.allocations = 0;
+        r.outcome = outcome == "ok" ? "time spent in warmup()" : outcome;
+        report("cold-start-warmup", "-", r);
+      }
+    }
+    std::filesystem::remove(path);
+  }
+#endif
+
+  std::vector<Scenario> make_scenarios()
+  {
+    std::vector<Scenario> r;
+
+    // Baseline: an ordinary three-certificate chain.
+    {
+      auto chain = certgen::make_chain(
+        {"bench leaf",
+         false,
+         {{"O", "didx509cpp"}},
+         "DNS:leaf.example",
+         "1.3.6.1.5.5.7.3.3"},
+        1);
+      const auto pem = certgen::to_pem(chain);
+      const auto did = certgen::did_prefix(chain.back()) +
+        "::subject:CN:bench%20leaf::eku:1.3.6.1.5.5.7.3.3";
+      r.push_back({"baseline", [=](const Limits& l) {
+                     resolve(pem, did, false, l);
+                   }});
+
+      // Rejected DID (wrong EKU) under strict and cost-ordered evaluation.
+      const auto wrong_eku = certgen::did_prefix(chain.back()) +
+        "::subject:CN:bench%20leaf::eku:1.2.3";
+      r.push_back({"reject-strict", [=](const Limits& l) {
+                     resolve(pem, wrong_eku, false, l, Evaluation::strict);
+                   }});
+      r.push_back({"reject-cost-ordered", [=](const Limits& l) {
+                     resolve(
+                       pem, wrong_eku, false, l, Evaluation::cost_ordered);
+                   }});
+      r.push_back({"baseline-cost-ordered", [=](const Limits& l) {
+                     resolve(pem, did, false, l, Evaluation::cost_ordered);
+                   }});
+
+      // The same resolution served from a warm ResolutionCache.
+      auto cache = std::make_shared<ResolutionCache>();
+      cache->resolve(pem, did);
+      r.push_back({"baseline-cached", [=](const Limits&) {
+                     cache->resolve(pem, did);
+                   }});
+
+      // One chain checked against 32 tenant DIDs, of which only the last
+      // matches: one call per DID versus a single resolve_chain_many().
+      std::vector<std::string> tenants;
+      for (size_t i = 0; i < 31; i++)
+      {
+        tenants.push_back(
+          certgen::did_prefix(chain.back()) + "::eku:1.3.6.1.4.1.99999." +
+          std::to_string(i));
+      }
+      tenants.push_back(did);
+      r.push_back({"tenants-one-by-one", [=](const Limits& l) {
+                     const UqSTACK_OF_X509 parsed(pem, l);
+                     for (const auto& t : tenants)
+                     {
+                       try
+                       {
+                         resolve_chain(parsed, t, false, l);
+                         return;
+                       }
+                       catch (const std::exception&)
+                       {}
+                     }
+                     throw std::runtime_error("no tenant matched");
+                   }});
+      r.push_back({"tenants-many", [=](const Limits& l) {
+                     const UqSTACK_OF_X509 parsed(pem, l);
+                     const auto m =
+                       resolve_chain_many(parsed, tenants, false, l);
+                     if (!m.matches.back().matched)
+                     {
+                       throw std::runtime_error("no tenant matched");
+                     }
+                   }});
+
+      // 50,000 configured DIDs of which one matches: a DidPolicyIndex lookup
+      // versus checking every DID.
+      auto configured = std::make_shared<std::vector<std::string>>();
+      for (size_t i = 0; i < 50000; i++)
+      {
+        configured->push_back(
+          certgen::did_prefix(chain.back()) + "::subject:CN:tenant" +
+          std::to_string(i) + "::eku:1.3.6.1.5.5.7.3.3");
+      }
+      configured->push_back(did);
+      auto index = std::make_shared<DidPolicyIndex>(*configured);
+      r.push_back({"did-index-50k", [=](const Limits& l) {
+                     const UqSTACK_OF_X509 parsed(pem, l);
+                     const auto valid =
+                       resolve_chain_many(parsed, {}, false, l).chain;
+                     if (index->match(valid).size() != 1)
+                     {
+                       throw std::runtime_error("unexpected matches");
+                     }
+                   }});
+      r.push_back({"did-loop-50k", [=](const Limits& l) {
+                     const UqSTACK_OF_X509 parsed(pem, l);
+                     const auto m =
+                       resolve_chain_many(parsed, *configured, false, l);
+                     if (!m.matches.back().matched)
+                     {
+                       throw std::runtime_error("unexpected matches");
+                     }
+                   }});
+
+      // Minting DIDs for 1,000 leaves under one CA: make_did() per leaf
+      // versus a DidGenerator that hashes the CA once.
+      std::vector<std::vector<DidPolicy>> leaves;
+      for (size_t i = 0; i < 1000; i++)
+      {
+        leaves.push_back(
+          {DidPolicy::subject({{"CN", "leaf " + std::to_string(i)}}),
+           DidPolicy::san("dns", "leaf" + std::to_string(i) + ".example"),
+           DidPolicy::eku("1.3.6.1.5.5.7.3.3")});
+      }
+      r.push_back({"mint-make-did-1k", [=](const Limits& l) {
+                     const UqSTACK_OF_X509 parsed(pem, l);
+                     for (const auto& policies : leaves)
+                     {
+                       static_cast<void>(
+                         make_did(parsed, 1, "sha256", policies));
+                     }
+                   }});
+      r.push_back({"mint-generator-1k", [=](const Limits& l) {
+                     const UqSTACK_OF_X509 parsed(pem, l);
+                     const DidGenerator generator(parsed.at(1), "sha256");
+                     static_cast<void>(generator.make_many(leaves));
+                   }});
+
+      // Oversized PEM input: the chain repeated to about 4 MiB.
+      std::string huge;
+      while (huge.size() < 4 * 1024 * 1024)
+      {
+        huge += pem;
+      }
+      r.push_back({"oversized-pem", [=](const Limits& l) {
+                     resolve(huge, did, false, l);
+                   }});
+
+      // DID with thousands of policies.
+      std::string many_policies = certgen::did_prefix(chain.back());
+      for (size_t i = 0; i < 5000; i++)
+      {
+        many_policies += "::eku:1.3.6.1.5.5.7.3.3";
+      }
+      many_policies += "::eku:1.2.3";
+      r.push_back({"many-policies", [=](const Limits& l) {
+                     resolve(pem, many_policies, false, l);
+                   }});
+
+      // Subject policy with thousands of key-value pairs.
+      std::string many_pairs =
+        certgen::did_prefix(chain.back()) + "::subject:CN:bench%20leaf";
+      for (size_t i = 0; i < 2000; i++)
+      {
+        many_pairs += ":" + std::to_string(i) + ":x";
+      }
+      r.push_back({"many-subject-pairs", [=](const Limits& l) {
+                     resolve(pem, many_pairs, false, l);
+                   }});
+    }
+
+    // Long chain of intermediates.
+    {
+      auto chain = certgen::make_chain({.common_name = "bench leaf"}, 60);
+      const auto pem = certgen::to_pem(chain);
+      const auto did =
+        certgen::did_prefix(chain.back()) + "::subject:CN:bench%20leaf";
+      r.push_back({"long-chain", [=](const Limits& l) {
+                     resolve(pem, did, false, l);
+                   }});
+    }
+
+    // Leaf with thousands of SANs, none of which match.
+    {
+      std::string san;
+      for (size_t i = 0; i < 4000; i++)
+      {
+        san += (i == 0 ? "" : ",") + std::string("DNS:host") +
+          std::to_string(i) + ".example";
+      }
+      auto chain =
+        certgen::make_chain({.common_name = "bench leaf", .san = san}, 1);
+      const auto pem = certgen::to_pem(chain);
+      const auto did =
+        certgen::did_prefix(chain.back()) + "::san:dns:missing.example";
+      r.push_back({"many-sans", [=](const Limits& l) {
+                     resolve(pem, did, false, l);
+                   }});
+    }
+
+    // Leaf with thousands of EKUs, none of which match.
+    {
+      std::string eku;
+      for (size_t i = 0; i < 2000; i++)
+      {
+        eku += (i == 0 ? "" : ",") + std::string("1.3.6.1.4.1.99999.") +
+          std::to_string(i);
+      }
+      auto chain =
+        certgen::make_chain({.common_name = "bench leaf", .eku = eku}, 1);
+      const auto pem = certgen::to_pem(chain);
+      const auto did = certgen::did_prefix(chain.back()) + "::eku:1.2.3";
+      r.push_back({"many-ekus", [=](const Limits& l) {
+                     resolve(pem, did, false, l);
+                   }});
+    }
+
+    // PEM parsing of a three-certificate chain, through the certificate
+    // reader and through OpenSSL's generic PEM reader.
+    {
+      const auto pem = certgen::to_pem(certgen::make_chain(
+        {"bench leaf", false, {{"O", "didx509cpp"}}, "", ""}, 1));
+      r.push_back({"parse-pem", [=](const Limits& l) {
+                     static_cast<void>(UqSTACK_OF_X509(pem, l));
+                   }});
+      r.push_back({"parse-pem-generic", [=](const Limits&) {
+                     const UqBIO mem(pem);
+                     static_cast<void>(UqSTACK_OF_X509_INFO(mem));
+                   }});
+    }
+
+    // Resolution against a file of 1000 trust anchors, loaded lazily through
+    // TrustBundle and eagerly by parsing every anchor into a store.
+    {
+      auto chain = certgen::make_chain({.common_name = "bench leaf"}, 1);
+      const auto pem = certgen::to_pem(chain);
+      std::string anchors = certgen::to_pem(chain.back().cert.get());
+      for (size_t i = 0; i < 999; i++)
+      {
+        anchors += certgen::to_pem(
+          certgen::issue(
+            {.common_name = "bench anchor " + std::to_string(i), .ca = true},
+            nullptr)
+            .cert.get());
+      }
+      const auto path =
+        (std::filesystem::temp_directory_path() / "didx509-bench-anchors.pem")
+          .string();
+      std::ofstream(path, std::ios::binary) << anchors;
+
+      r.push_back({"trust-bundle-1k", [=](const Limits& l) {
+                     const TrustBundle bundle(path);
+                     const UqSTACK_OF_X509 presented(pem, l);
+                     static_cast<void>(bundle.verify(presented, false, l));
+                   }});
+      r.push_back({"trust-bundle-1k-eager", [=](const Limits& l) {
+                     const UqSTACK_OF_X509 all(
+                       std::string(MappedFile(path).view()),
+                       Limits::unlimited());
+                     std::vector<UqX509> roots;
+                     for (size_t i = 0; i < all.size(); i++)
+                     {
+                       roots.emplace_back(all.at(i));
+                     }
+                     const UqSTACK_OF_X509 presented(pem, l);
+                     static_cast<void>(
+                       presented.verify(roots, false, true, l));
+                   }});
+    }
+
+    // Percent-decoding of policy values with and without escapes.
+    {
+      const std::string plain(256, 'v');
+      std::string escaped;
+      for (size_t i = 0; i < 64; i++)
+      {
+        escaped += "abc%20";
+      }
+      r.push_back({"url-unescape-plain", [=](const Limits&) {
+                     for (size_t i = 0; i < 1000; i++)
+                     {
+                       static_cast<void>(url_unescape(plain));
+                     }
+                   }});
+      r.push_back({"url-unescape-escaped", [=](const Limits&) {
+                     for (size_t i = 0; i < 1000; i++)
+                     {
+                       static_cast<void>(url_unescape(escaped));
+                     }
+                   }});
+    }
+
+    // JSON escaping of a long, mostly clean string.
+    {
+      std::string s;
+      for (size_t i = 0; i < 64 * 1024; i++)
+      {
+        s += i % 1000 == 999 ? '"' : static_cast<char>('a' + i % 26);
+      }
+      r.push_back({"json-escape-64k-scalar", [=](const Limits&) {
+                     static_cast<void>(json_escape_string_scalar(s));
+                   }});
+      r.push_back({"json-escape-64k", [=](const Limits&) {
+                     static_cast<void>(json_escape_string(s));
+                   }});
+    }
+
+    return r;
+  }
+}
+
+int main(int argc, char** argv)
+{
+  std::string filter;
+  for (int i = 1; i < argc; i++)
+  {
+    if (std::strcmp(argv[i], "--filter") == 0 && i + 1 < argc)
+    {
+      filter = argv[++i];
+    }
+  }
+
+  // Must run before OpenSSL allocates anything to see its allocations too.
+  if (CRYPTO_set_mem_functions(
+        counting_malloc, counting_realloc, counting_free) == 0)
+  {
+    std::cerr << "note: OpenSSL allocations are not counted\n";
+  }
+
+#if defined(__linux__)
+  if (argc == 4 && std::strcmp(argv[1], "--cold-child") == 0)
+  {
+    return cold_start_child(argv[2], argv[3]);
+  }
+#endif
+
+  std::cout << std::left << std::setw(28) << "scenario" << std::setw(11)
+            << "limits" << std::right << std::setw(12) << "median us"
+            << std::setw(12) << "max us" << std::setw(8) << "iters"
+            << std::setw(10) << "allocs" << std::setw(12) << "instr"
+            << "  outcome\n";
+
+  for (const auto& scenario : make_scenarios())
+  {
+    if (scenario.name.find(filter) == std::string::npos)
+    {
+      continue;
+    }
+    const Limits defaults;
+    report(
+      scenario.name, "default", measure([&]() { scenario.run(defaults); }));
+    const auto unlimited = Limits::unlimited();
+    report(
+      scenario.name,
+      "unlimited",
+      measure([&]() { scenario.run(unlimited); }, std::chrono::seconds(2), 50));
+  }
+#if defined(__linux__)
+  cold_start(filter);
+#endif
+  return 0;
+}
@@ -0,0 +1,189 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT License.
+
+// Generation of throwaway certificate chains for benchmarks.
+
+#pragma once
+
+#include "didx509cpp.h"
+
+#include <algorithm>
+#include <memory>
+#include <openssl/evp.h>
+#include <openssl/pem.h>
+#include <openssl/x509.h>
+#include <openssl/x509v3.h>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace certgen
+{
+  using Key = std::unique_ptr<EVP_PKEY, decltype(&EVP_PKEY_free)>;
+  using Cert = std::unique_ptr<X509, decltype(&X509_free)>;
+
+  inline void check(int rc, const char* what)
+  {
+    if (rc != 1)
+    {
+      throw std::runtime_error(std::string("certgen: ") + what + " failed");
+    }
+  }
+
+  inline Key make_key()
+  {
+    std::unique_ptr<EVP_PKEY_CTX, decltype(&EVP_PKEY_CTX_free)> ctx(
+      EVP_PKEY_CTX_new_id(EVP_PKEY_EC, nullptr), EVP_PKEY_CTX_free);
+    check(EVP_PKEY_keygen_init(ctx.get()), "keygen init");
+    check(
+      EVP_PKEY_CTX_set_ec_paramgen_curve_nid(ctx.get(), NID_X9_62_prime256v1),
+      "set curve");
+    EVP_PKEY* key = nullptr;
+    check(EVP_PKEY_keygen(ctx.get(), &key), "keygen");
+    return {key, EVP_PKEY_free};
+  }
+
+  struct Spec
+  {
+    std::string common_name = {};
+    bool ca = false;
+    std::vector<std::pair<std::string, std::string>> extra_subject = {};
+    /// Comma-separated subjectAltName value, e.g. "DNS:a.example,DNS:b".
+    std::string san = {};
+    /// Comma-separated extendedKeyUsage value, e.g. "1.2.3,1.2.4".
+    std::string eku = {};
+  };
+
+  struct Issued
+  {
+    Cert cert;
+    Key key;
+  };
+
+  inline void add_ext(
+    X509V3_CTX& ctx, X509* cert, int nid, const std::string& v)
+  {
+    X509_EXTENSION* ext =
+      X509V3_EXT_conf_nid(nullptr, &ctx, nid, (char*)v.c_str());
+    if (ext == nullptr)
+    {
+      throw std::runtime_error("certgen: invalid extension " + v);
+    }
+    X509_add_ext(cert, ext, -1);
+    X509_EXTENSION_free(ext);
+  }
+
+  /// Issues a certificate for `spec`, signed by `issuer`, or self-signed if
+  /// `issuer` is nullptr.
+  inline Issued issue(const Spec& spec, const Issued* issuer)
+  {
+    static long serial = 1;
+    Issued r{Cert(X509_new(), X509_free), make_key()};
+    X509* cert = r.cert.get();
+    check(X509_set_version(cert, 2), "set version");
+    ASN1_INTEGER_set(X509_get_serialNumber(cert), serial++);
+    X509_gmtime_adj(X509_getm_notBefore(cert), -24 * 3600);
+    X509_gmtime_adj(X509_getm_notAfter(cert), 365L * 24 * 3600);
+    check(X509_set_pubkey(cert, r.key.get()), "set pubkey");
+
+    X509_NAME* name = X509_get_subject_name(cert);
+    X509_NAME_add_entry_by_txt(
+      name,
+      "CN",
+      MBSTRING_UTF8,
+      (const unsigned char*)spec.common_name.c_str(),
+      -1,
+      -1,
+      0);
+    for (const auto& [k, v] : spec.extra_subject)
+    {
+      X509_NAME_add_entry_by_txt(
+        name,
+        k.c_str(),
+        MBSTRING_UTF8,
+        (const unsigned char*)v.c_str(),
+        -1,
+        -1,
+        0);
+    }
+    X509* issuer_cert = issuer != nullptr ? issuer->cert.get() : cert;
+    EVP_PKEY* issuer_key = issuer != nullptr ? issuer->key.get() : r.key.get();
+    check(
+      X509_set_issuer_name(cert, X509_get_subject_name(issuer_cert)),
+      "set issuer");
+
+    X509V3_CTX ctx;
+    X509V3_set_ctx(&ctx, issuer_cert, cert, nullptr, nullptr, 0);
+    add_ext(ctx, cert, NID_subject_key_identifier, "hash");
+    add_ext(ctx, cert, NID_authority_key_identifier, "keyid:always");
+    if (spec.ca)
+    {
+      add_ext(ctx, cert, NID_basic_constraints, "critical,CA:TRUE");
+      add_ext(ctx, cert, NID_key_usage, "critical,keyCertSign,cRLSign");
+    }
+    else
+    {
+      add_ext(ctx, cert, NID_basic_constraints, "critical,CA:FALSE");
+      add_ext(ctx, cert, NID_key_usage, "critical,digitalSignature");
+    }
+    if (!spec.san.empty())
+    {
+      add_ext(ctx, cert, NID_subject_alt_name, spec.san);
+    }
+    if (!spec.eku.empty())
+    {
+      add_ext(ctx, cert, NID_ext_key_usage, spec.eku);
+    }
+
+    if (X509_sign(cert, issuer_key, EVP_sha256()) == 0)
+    {
+      throw std::runtime_error("certgen: signing failed");
+    }
+    return r;
+  }
+
+  /// A root, `intermediates` intermediate CAs and a leaf described by `leaf`.
+  /// The chain is ordered leaf first, as expected by didx509.
+  inline std::vector<Issued> make_chain(const Spec& leaf, size_t intermediates)
+  {
+    std::vector<Issued> issued;
+    issued.push_back(issue(
+      {.common_name = "didx509cpp bench root", .ca = true}, nullptr));
+    for (size_t i = 0; i < intermediates; i++)
+    {
+      issued.push_back(issue(
+        {.common_name = "didx509cpp bench intermediate " + std::to_string(i),
+         .ca = true},
+        &issued.back()));
+    }
+    issued.push_back(issue(leaf, &issued.back()));
+    std::reverse(issued.begin(), issued.end());
+    return issued;
+  }
+
+  inline std::string to_pem(X509* cert)
+  {
+    didx509::UqBIO bio;
+    check(PEM_write_bio_X509(bio, cert), "PEM write");
+    return bio.to_string();
+  }
+
+  inline std::string to_pem(const std::vector<Issued>& chain)
+  {
+    std::string r;
+    for (const auto& c : chain)
+    {
+      r += to_pem(c.cert.get());
+    }
+    return r;
+  }
+
+  /// did:x509 prefix pinning `ca` by its SHA-256 fingerprint.
+  inline std::string did_prefix(const Issued& ca)
+  {
+    const didx509::UqX509 x(ca.cert.get());
+    return "did:x509:0:sha256:" +
+      didx509::to_base64url(didx509::sha256(x.der()));
+  }
+}
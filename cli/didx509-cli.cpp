@@ -0,0 +1,400 @@
+// Copyright (c) Microsoft Corporation.
+// Licensed under the MIT License.
+
+// Bulk resolver for offline audits. Reads NDJSON records of the form
+//
+//   {"chain": <PEM bundle string or array of PEM strings>, "did": "...",
+//    "time": ...}
+//
+// from a file or stdin, resolves them in parallel and writes one NDJSON result
+// per input record, in input order, followed by a throughput summary on
+// stderr.
+
+#include "didx509cpp.h"
+
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "json.hpp"
+
+using namespace didx509;
+
+namespace
+{
+  struct Options
+  {
+    std::string input = "-";
+    std::string output = "-";
+    size_t threads = std::thread::hardware_concurrency();
+    size_t batch_size = 4096;
+    bool ignore_time = false;
+    bool documents = true;
+    Evaluation evaluation = Evaluation::strict;
+  };
+
+  void usage(const char* argv0)
+  {
+    std::cerr
+      << "Usage: " << argv0 << " [options]\n"
+      << "\n"
+      << "Resolves NDJSON records {\"chain\": ..., \"did\": ..., \"time\": ...}"
+      << "\n"
+      << "and writes one NDJSON result per record.\n"
+      << "\n"
+      << "Options:\n"
+      << "  --input FILE       read records from FILE (default: stdin)\n"
+      << "  --output FILE      write results to FILE (default: stdout)\n"
+      << "  --threads N        number of worker threads, at most 1024\n"
+      << "                     (default: all cores)\n"
+      << "  --batch-size N     records resolved per parallel batch, at most\n"
+      << "                     1048576 (default: 4096)\n"
+      << "  --ignore-time      skip validity period checks; otherwise records\n"
+      << "                     are checked at their \"time\", or now\n"
+      << "  --no-document      omit the DID document from results\n"
+      << "  --cost-ordered     check policies before the chain, so rejected\n"
+      << "                     records skip chain verification; the error\n"
+      << "                     may differ when several checks fail\n"
+      << "  --help             show this message\n";
+  }
+
+  // Upper bounds for numeric options, well beyond any useful setting.
+  constexpr size_t max_threads = 1024;
+  constexpr size_t max_batch_size = 1 << 20;
+
+  // Parses the value of a numeric option: decimal digits only, so that
+  // signs and trailing garbage are rejected, and at most `max`.
+  size_t parse_count(
+    const std::string& option, const std::string& text, size_t max)
+  {
+    size_t r = 0;
+    for (const char c : text)
+    {
+      if (std::isdigit((unsigned char)c) == 0)
+      {
+        r = max + 1;
+        break;
+      }
+      r = std::min(r * 10 + (c - '0'), max + 1);
+    }
+    if (text.empty() || r > max)
+    {
+      throw std::invalid_argument(
+        "invalid value for " + option + ": " + text + " (expected 0 to " +
+        std::to_string(max) + ")");
+    }
+    return r;
+  }
+
+  bool parse_options(int argc, char** argv, Options& options)
+  {
+    for (int i = 1; i < argc; i++)
+    {
+      const std::string arg = argv[i];
+      auto value = [&]() -> std::string {
+        if (i + 1 >= argc)
+        {
+          throw std::invalid_argument("missing value for " + arg);
+        }
+        return argv[++i];
+      };
+
+      if (arg == "--input")
+      {
+        options.input = value();
+      }
+      else if (arg == "--output")
+      {
+        options.output = value();
+      }
+      else if (arg == "--threads")
+      {
+        options.threads = parse_count(arg, value(), max_threads);
+      }
+      else if (arg == "--batch-size")
+      {
+        options.batch_size =
+          std::max<size_t>(parse_count(arg, value(), max_batch_size), 1);
+      }
+      else if (arg == "--ignore-time")
+      {
+        options.ignore_time = true;
+      }
+      else if (arg == "--no-document")
+      {
+        options.documents = false;
+      }
+      else if (arg == "--cost-ordered")
+      {
+        options.evaluation = Evaluation::cost_ordered;
+      }
+      else if (arg == "--help")
+      {
+        usage(argv[0]);
+        return false;
+      }
+      else
+      {
+        throw std::invalid_argument("unknown option " + arg);
+      }
+    }
+    return true;
+  }
+
+  struct Record
+  {
+    size_t line = 0;
+    std::string text = {};
+    std::string result = {};
+    bool ok = false;
+  };
+
+  // Returns the value of the `n` decimal digits at `text[pos]`, or -1 if there
+  // are fewer than `n` characters or they are not all digits.
+  int fixed_digits(std::string_view text, size_t pos, size_t n)
+  {
+    if (pos + n > text.size())
+    {
+      return -1;
+    }
+    int r = 0;
+    for (size_t i = pos; i < pos + n; i++)
+    {
+      if (std::isdigit((unsigned char)text[i]) == 0)
+      {
+        return -1;
+      }
+      r = r * 10 + (text[i] - '0');
+    }
+    return r;
+  }
+
+  // Parses a record's "time": either seconds since the Unix epoch or an RFC
+  // 3339 date-time such as "2023-01-31T12:00:00Z" or
+  // "2023-01-31T13:00:00.5+01:00".
+  std::chrono::system_clock::time_point parse_time(const nlohmann::json& time)
+  {
+    using namespace std::chrono;
+    if (time.is_number())
+    {
+      return system_clock::time_point{
+        duration_cast<system_clock::duration>(
+          duration<double>(time.get<double>()))};
+    }
+
+    const auto text = time.get<std::string>();
+    const int y = fixed_digits(text, 0, 4), mo = fixed_digits(text, 5, 2),
+              d = fixed_digits(text, 8, 2), h = fixed_digits(text, 11, 2),
+              mi = fixed_digits(text, 14, 2), sec = fixed_digits(text, 17, 2);
+    if (
+      y < 0 || mo < 0 || d < 0 || h < 0 || mi < 0 || sec < 0 ||
+      text[4] != '-' || text[7] != '-' ||
+      (text[10] != 'T' && text[10] != 't' && text[10] != ' ') ||
+      text[13] != ':' || text[16] != ':')
+    {
+      throw std::runtime_error("invalid time: " + text);
+    }
+    const year_month_day date{year{y}, month(mo), day(d)};
+    if (!date.ok() || h > 23 || mi > 59 || sec > 60)
+    {
+      throw std::runtime_error("invalid time: " + text);
+    }
+    auto r = system_clock::time_point{sys_days{date}} + hours{h} +
+      minutes{mi} + seconds{sec};
+
+    size_t i = 19;
+    if (i < text.size() && text[i] == '.')
+    {
+      size_t j = i + 1;
+      while (j < text.size() && std::isdigit((unsigned char)text[j]) != 0)
+      {
+        j++;
+      }
+      r += duration_cast<system_clock::duration>(
+        duration<double>(std::stod("0" + text.substr(i, j - i))));
+      i = j;
+    }
+
+    if (i + 1 == text.size() && (text[i] == 'Z' || text[i] == 'z'))
+    {
+      return r;
+    }
+    const int oh = fixed_digits(text, i + 1, 2);
+    const int om = fixed_digits(text, i + 4, 2);
+    if (
+      i + 6 == text.size() && (text[i] == '+' || text[i] == '-') &&
+      text[i + 3] == ':' && oh >= 0 && oh <= 23 && om >= 0 && om <= 59)
+    {
+      const auto offset = hours{oh} + minutes{om};
+      return text[i] == '+' ? r - offset : r + offset;
+    }
+    throw std::runtime_error("invalid time: " + text);
+  }
+
+  struct Resolved
+  {
+    std::string did;
+    UqSTACK_OF_X509 chain;
+  };
+
+  Resolved resolve_record(const Record& record, const Options& options)
+  {
+    const auto json = nlohmann::json::parse(record.text);
+    const auto& chain_json = json.at("chain");
+    auto did = json.at("did").get<std::string>();
+
+    const UqSTACK_OF_X509 chain = chain_json.is_array() ?
+      UqSTACK_OF_X509(chain_json.get<std::vector<std::string>>()) :
+      UqSTACK_OF_X509(chain_json.get<std::string>());
+    auto valid_chain = !options.ignore_time && json.contains("time") ?
+      resolve_chain(
+        chain, did, parse_time(json["time"]), {}, options.evaluation) :
+      resolve_chain(chain, did, options.ignore_time, {}, options.evaluation);
+    return {.did = std::move(did), .chain = std::move(valid_chain)};
+  }
+
+  // Appends the serialized JSON `json` to `out` without its line breaks and
+  // the indentation that follows them. JSON strings cannot contain raw line
+  // breaks, so this leaves the value unchanged.
+  void append_single_line(std::string& out, std::string_view json)
+  {
+    out.reserve(out.size() + json.size());
+    for (size_t i = 0; i < json.size(); i++)
+    {
+      if (json[i] == '\n')
+      {
+        while (i + 1 < json.size() && json[i + 1] == ' ')
+        {
+          i++;
+        }
+        continue;
+      }
+      out += json[i];
+    }
+  }
+
+  void process(Record& record, const Options& options)
+  {
+    nlohmann::json result;
+    result["line"] = record.line;
+    try
+    {
+      const auto resolved = resolve_record(record, options);
+      result["ok"] = true;
+      record.result = result.dump();
+      if (options.documents)
+      {
+        // The document is already serialized JSON; splice it in as the last
+        // member rather than parsing it back into a json value.
+        record.result.pop_back();
+        record.result += ",\"document\":";
+        append_single_line(
+          record.result, create_did_document(resolved.did, resolved.chain));
+        record.result += "}";
+      }
+      record.ok = true;
+      return;
+    }
+    catch (const std::exception& e)
+    {
+      result["ok"] = false;
+      result["error"] = e.what();
+    }
+    record.result = result.dump();
+  }
+}
+
+int main(int argc, char** argv)
+{
+  Options options;
+  try
+  {
+    if (!parse_options(argc, argv, options))
+    {
+      return 0;
+    }
+  }
+  catch (const std::exception& e)
+  {
+    std::cerr << "error: " << e.what() << "\n";
+    usage(argv[0]);
+    return 2;
+  }
+
+  std::ifstream input_file;
+  if (options.input != "-")
+  {
+    input_file.open(options.input);
+    if (!input_file.good())
+    {
+      std::cerr << "error: could not open " << options.input << "\n";
+      return 2;
+    }
+  }
+  std::istream& in = options.input == "-" ? std::cin : input_file;
+
+  std::ofstream output_file;
+  if (options.output != "-")
+  {
+    output_file.open(options.output);
+    if (!output_file.good())
+    {
+      std::cerr << "error: could not open " << options.output << "\n";
+      return 2;
+    }
+  }
+  std::ostream& out = options.output == "-" ? std::cout : output_file;
+
+  ThreadPool pool(options.threads);
+
+  size_t total = 0;
+  size_t failed = 0;
+  size_t line = 0;
+  const auto start = std::chrono::steady_clock::now();
+
+  std::vector<Record> batch;
+  batch.reserve(options.batch_size);
+  auto flush = [&]() {
+    parallel_for(
+      pool, batch.size(), [&](size_t i) { process(batch[i], options); });
+    for (const auto& record : batch)
+    {
+      out << record.result << "\n";
+      total++;
+      failed += record.ok ? 0 : 1;
+    }
+    batch.clear();
+  };
+
+  std::string text;
+  while (std::getline(in, text))
+  {
+    line++;
+    if (text.find_first_not_of(" \t\r") == std::string::npos)
+    {
+      continue;
+    }
+    batch.push_back({.line = line, .text = std::move(text)});
+    if (batch.size() == options.batch_size)
+    {
+      flush();
+    }
+  }
+  flush();
+  out.flush();
+
+  const std::chrono::duration<double> elapsed =
+    std::chrono::steady_clock::now() - start;
+  std::cerr << "records: " << total << ", ok: " << total - failed
+            << ", failed: " << failed << ", threads: " << concurrency(pool)
+            << ", seconds: " << elapsed.count() << ", records/s: "
+            << (elapsed.count() > 0 ? (double)total / elapsed.count() : 0.0)
+            << "\n";
+
+  return failed == 0 ? 0 : 1;
+}
@@ -3,14 +3,31 @@
 
 #pragma once
 
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <concepts>
+#include <condition_variable>
+#include <coroutine>
+#include <cstdio>
 #include <cstring>
 #include <cstdint>
 #include <cstdlib>
 #include <ctime>
+#include <deque>
+#include <exception>
+#include <fstream>
+#include <functional>
 #include <initializer_list>
 #include <limits>
+#include <list>
 #include <memory>
 #include <map>
+#include <mutex>
+#include <optional>
+#include <span>
 #include <openssl/asn1.h>
 #include <openssl/bio.h>
 #include <openssl/bn.h>
@@ -27,6 +44,10 @@
 #include <openssl/x509v3.h>
 #include <stdexcept>
 #include <string>
+#include <string_view>
+#include <thread>
+#include <type_traits>
+#include <unordered_map>
 #include <unordered_set>
 #include <utility>
 #include <vector>
@@ -36,10 +57,322 @@
 #  include <openssl/types.h>
 #endif
 
+#if defined(__x86_64__) || defined(_M_X64)
+#  include <immintrin.h>
+#  define DIDX509CPP_JSON_SSE2
+#  if defined(__GNUC__) || defined(__clang__)
+#    define DIDX509CPP_JSON_AVX2
+#  endif
+#endif
+
+#if defined(__unix__) || defined(__APPLE__)
+#  include <fcntl.h>
+#  include <sys/mman.h>
+#  include <sys/stat.h>
+#  include <unistd.h>
+#  define DIDX509CPP_MMAP
+#else
+#  include <iterator>
+#endif
+
 namespace didx509
 {
+  /// Bounds on untrusted input. They are checked before the corresponding
+  /// expensive work (PEM parsing, chain building, DID evaluation) so that a
+  /// single crafted request cannot take unbounded time. The defaults are well
+  /// above what legitimate chains and DIDs need.
+  struct Limits
+  {
+    /// Total size of the PEM input, in bytes.
+    size_t max_pem_bytes = 256 * 1024;
+    /// Certificates in the presented chain; also bounds the verification
+    /// depth.
+    size_t max_certificates = 16;
+    /// Length of the DID string, in bytes.
+    size_t max_did_bytes = 8 * 1024;
+    /// Number of `::`-separated policies in the DID.
+    size_t max_policies = 32;
+    /// Key-value pairs in a single subject policy.
+    size_t max_subject_pairs = 32;
+    /// Entries scanned in the leaf's subject alternative name extensions.
+    size_t max_san_entries = 1024;
+    /// Entries scanned in the leaf's extended key usage extensions.
+    size_t max_eku_entries = 256;
+
+    /// Limits that never trigger, i.e. the behaviour before limits existed.
+    static Limits unlimited()
+    {
+      constexpr auto max = std::numeric_limits<size_t>::max();
+      return {max, max, max, max, max, max, max};
+    }
+  };
+
+  /// Order in which resolution evaluates its checks.
+  enum class Evaluation
+  {
+    /// Chain verification, then the CA fingerprint, then each policy in the
+    /// order it appears in the DID. The reported error is that of the first
+    /// failing check in this order.
+    strict,
+    /// DID syntax and the leaf's policies first, cheapest first (EKU, SAN,
+    /// subject, Fulcio), then the CA fingerprint, and chain verification
+    /// last; the first failure rejects. Accept/reject decisions are the same
+    /// as for strict evaluation, and so is the error whenever a single check
+    /// fails, but rejected requests mostly skip chain verification.
+    cost_ordered,
+  };
+
+  /// Sigstore claims carried in a Fulcio-issued leaf certificate, see
+  /// https://github.com/sigstore/fulcio/blob/main/docs/oid-info.md. Each
+  /// member is set if the corresponding 1.3.6.1.4.1.57264.1.<n> extension is
+  /// present.
+  struct FulcioClaims
+  {
+    /// .1 (deprecated): OIDC issuer, raw extension bytes.
+    std::optional<std::string> issuer;
+    /// .2 to .6 (deprecated): GitHub Actions claims, raw extension bytes.
+    std::optional<std::string> github_workflow_trigger;
+    std::optional<std::string> github_workflow_sha;
+    std::optional<std::string> github_workflow_name;
+    std::optional<std::string> github_workflow_repository;
+    std::optional<std::string> github_workflow_ref;
+    /// .8 to .22: DER UTF8String values.
+    std::optional<std::string> issuer_v2;
+    std::optional<std::string> build_signer_uri;
+    std::optional<std::string> build_signer_digest;
+    std::optional<std::string> runner_environment;
+    std::optional<std::string> source_repository_uri;
+    std::optional<std::string> source_repository_digest;
+    std::optional<std::string> source_repository_ref;
+    std::optional<std::string> source_repository_identifier;
+    std::optional<std::string> source_repository_owner_uri;
+    std::optional<std::string> source_repository_owner_identifier;
+    std::optional<std::string> build_config_uri;
+    std::optional<std::string> build_config_digest;
+    std::optional<std::string> build_trigger;
+    std::optional<std::string> run_invocation_uri;
+    std::optional<std::string> source_repository_visibility_at_signing;
+
+    /// The OIDC issuer, preferring the v2 extension when both are present.
+    [[nodiscard]] const std::optional<std::string>& oidc_issuer() const
+    {
+      return issuer_v2 ? issuer_v2 : issuer;
+    }
+  };
+
+  /// Stages of a resolution that are reported to an Observer.
+  enum class Stage
+  {
+    parse_pem,
+    verify_chain,
+    check_fingerprint,
+    policy,
+    public_jwk,
+    create_did_document,
+  };
+
+  /// Policy evaluated during a Stage::policy event.
+  enum class PolicyType
+  {
+    none,
+    subject,
+    san,
+    eku,
+    fulcio_issuer,
+    unknown,
+  };
+
+  /// Category of the failure reported in an unsuccessful StageEvent.
+  enum class ErrorCategory
+  {
+    none,
+    chain_verification,
+    unsupported_fingerprint_algorithm,
+    fingerprint_mismatch,
+    subject_mismatch,
+    san_not_found,
+    eku_not_found,
+    fulcio_issuer_mismatch,
+    other,
+  };
+
+  struct StageEvent
+  {
+    Stage stage = Stage::parse_pem;
+    PolicyType policy = PolicyType::none;
+    std::chrono::steady_clock::time_point begin;
+    /// Equal to begin in on_stage_begin().
+    std::chrono::steady_clock::time_point end;
+    /// Whether the stage completed without throwing; always true in
+    /// on_stage_begin().
+    bool success = true;
+    /// Why an unsuccessful stage failed.
+    ErrorCategory error = ErrorCategory::none;
+    /// X509_V_ERR_* code for ErrorCategory::chain_verification failures.
+    int x509_error = 0;
+  };
+
+  inline const char* to_string(Stage stage)
+  {
+    switch (stage)
+    {
+      case Stage::parse_pem:
+        return "parse_pem";
+      case Stage::verify_chain:
+        return "verify_chain";
+      case Stage::check_fingerprint:
+        return "check_fingerprint";
+      case Stage::policy:
+        return "policy";
+      case Stage::public_jwk:
+        return "public_jwk";
+      case Stage::create_did_document:
+        return "create_did_document";
+    }
+    return "unknown";
+  }
+
+  inline const char* to_string(PolicyType policy)
+  {
+    switch (policy)
+    {
+      case PolicyType::none:
+        return "none";
+      case PolicyType::subject:
+        return "subject";
+      case PolicyType::san:
+        return "san";
+      case PolicyType::eku:
+        return "eku";
+      case PolicyType::fulcio_issuer:
+        return "fulcio-issuer";
+      case PolicyType::unknown:
+        return "unknown";
+    }
+    return "unknown";
+  }
+
+  inline const char* to_string(ErrorCategory error)
+  {
+    switch (error)
+    {
+      case ErrorCategory::none:
+        return "none";
+      case ErrorCategory::chain_verification:
+        return "chain_verification";
+      case ErrorCategory::unsupported_fingerprint_algorithm:
+        return "unsupported_fingerprint_algorithm";
+      case ErrorCategory::fingerprint_mismatch:
+        return "fingerprint_mismatch";
+      case ErrorCategory::subject_mismatch:
+        return "subject_mismatch";
+      case ErrorCategory::san_not_found:
+        return "san_not_found";
+      case ErrorCategory::eku_not_found:
+        return "eku_not_found";
+      case ErrorCategory::fulcio_issuer_mismatch:
+        return "fulcio_issuer_mismatch";
+      case ErrorCategory::other:
+        return "other";
+    }
+    return "unknown";
+  }
+
+  /// Receives begin/end events for each stage of resolve(), resolve_chain()
+  /// and resolve_jwk(). Events are delivered synchronously on the resolving
+  /// thread, so implementations must be thread-safe, cheap and must not
+  /// throw.
+  ///
+  /// Instrumentation is compiled in only when DIDX509CPP_INSTRUMENTATION is
+  /// defined; otherwise all hooks compile to nothing and set_observer() is not
+  /// available.
+  class Observer
+  {
+  public:
+    virtual ~Observer() = default;
+
+    virtual void on_stage_begin(const StageEvent& /*event*/) {}
+
+    virtual void on_stage_end(const StageEvent& /*event*/) {}
+  };
+
+#ifdef DIDX509CPP_INSTRUMENTATION
+  inline std::atomic<Observer*> global_observer{nullptr};
+
+  /// Installs the process-wide observer; pass nullptr to remove it. The
+  /// observer must outlive all resolutions that may still be reporting to it.
+  inline void set_observer(Observer* observer)
+  {
+    global_observer.store(observer, std::memory_order_release);
+  }
+#endif
+
   namespace
   {
+#ifdef DIDX509CPP_INSTRUMENTATION
+    /// Reports the enclosing scope as a stage to the installed observer. A
+    /// scope that is left by an exception is reported as unsuccessful.
+    class StageScope
+    {
+    public:
+      StageScope(Stage stage, PolicyType policy = PolicyType::none) :
+        observer(global_observer.load(std::memory_order_acquire))
+      {
+        if (observer != nullptr)
+        {
+          event.stage = stage;
+          event.policy = policy;
+          event.begin = std::chrono::steady_clock::now();
+          event.end = event.begin;
+          exceptions = std::uncaught_exceptions();
+          observer->on_stage_begin(event);
+        }
+      }
+
+      StageScope(const StageScope&) = delete;
+      StageScope& operator=(const StageScope&) = delete;
+
+      ~StageScope()
+      {
+        if (observer != nullptr)
+        {
+          event.end = std::chrono::steady_clock::now();
+          event.success = std::uncaught_exceptions() == exceptions;
+          if (event.success)
+          {
+            event.error = ErrorCategory::none;
+            event.x509_error = 0;
+          }
+          else if (event.error == ErrorCategory::none)
+          {
+            event.error = ErrorCategory::other;
+          }
+          observer->on_stage_end(event);
+        }
+      }
+
+      /// Records why the stage is about to fail; call just before throwing.
+      void fail(ErrorCategory error, int x509_error = 0)
+      {
+        event.error = error;
+        event.x509_error = x509_error;
+      }
+
+    private:
+      Observer* observer;
+      StageEvent event;
+      int exceptions = 0;
+    };
+#else
+    struct StageScope
+    {
+      constexpr StageScope(Stage /*stage*/, PolicyType /*policy*/ = {}) noexcept
+      {}
+
+      constexpr void fail(ErrorCategory /*error*/, int /*x509_error*/ = 0) {}
+    };
+#endif
+
     inline std::string error_string(unsigned long ec)
 #ifdef _DEBUG
       __attribute__((noinline))
@@ -135,20 +468,51 @@ namespace didx509
       return r;
     }
 
-    template <class T, T* (*CTOR)(), void (*DTOR)(T*)>
+    /// Deleter that calls DTOR. It is stateless, so a unique_ptr using it is
+    /// pointer-sized and the call can be inlined.
+    template <auto DTOR>
+    struct SSLDeleter
+    {
+      template <class T>
+      void operator()(T* x) const
+      {
+        DTOR(x);
+      }
+    };
+
+    inline void free_general_names(STACK_OF(GENERAL_NAME) * x)
+    {
+      sk_GENERAL_NAME_pop_free(x, GENERAL_NAME_free);
+    }
+
+    inline void free_x509_infos(STACK_OF(X509_INFO) * x)
+    {
+      sk_X509_INFO_pop_free(x, X509_INFO_free);
+    }
+
+    inline void free_x509s(STACK_OF(X509) * x)
+    {
+      sk_X509_pop_free(x, X509_free);
+    }
+
+    /// Owning wrapper for an OpenSSL object that is freed with DTOR. Objects
+    /// that are only borrowed are passed as raw pointers or views (see
+    /// X509View) instead, so that nothing is duplicated or reference-counted
+    /// just to be read.
+    template <class T, T* (*CTOR)(), auto DTOR>
     class UqSSLOBJECT
     {
     protected:
-      std::unique_ptr<T, void (*)(T*)> p;
+      std::unique_ptr<T, SSLDeleter<DTOR>> p;
 
     public:
-      UqSSLOBJECT() : p(CTOR(), DTOR)
+      UqSSLOBJECT() : p(CTOR())
       {
         CHECKNULL(p.get());
       }
 
-      UqSSLOBJECT(T* ptr, void (*dtor)(T*), bool check_null = true) :
-        p(ptr, dtor)
+      /// Takes ownership of ptr.
+      UqSSLOBJECT(T* ptr, bool check_null = true) : p(ptr)
       {
         if (check_null)
         {
@@ -187,35 +551,32 @@ namespace didx509
 
     struct UqBIGNUM : public UqSSLOBJECT<BIGNUM, BN_new, BN_free>
     {
-      UqBIGNUM(const BIGNUM* n) : UqSSLOBJECT(BN_dup(n), BN_free) {}
+      UqBIGNUM(const BIGNUM* n) : UqSSLOBJECT(BN_dup(n)) {}
 
-      UqBIGNUM(UqBIGNUM&& other) noexcept : UqSSLOBJECT(nullptr, BN_free, false)
+      UqBIGNUM(UqBIGNUM&& other) noexcept : UqSSLOBJECT(nullptr, false)
       {
         p = std::move(other.p);
       }
     };
 
-    struct UqBIO : public UqSSLOBJECT<BIO, nullptr, nullptr>
+    struct UqBIO : public UqSSLOBJECT<BIO, nullptr, BIO_free_all>
     {
-      UqBIO() : UqSSLOBJECT(BIO_new(BIO_s_mem()), [](auto x) { BIO_free(x); })
+      UqBIO() : UqSSLOBJECT(BIO_new(BIO_s_mem()))
       {}
 
       UqBIO(const void* buf, int len) :
-        UqSSLOBJECT(BIO_new_mem_buf(buf, len), [](auto x) { BIO_free(x); })
+        UqSSLOBJECT(BIO_new_mem_buf(buf, len))
       {}
 
       UqBIO(const std::string& s) :
-        UqSSLOBJECT(
-          BIO_new_mem_buf(s.data(), s.size()), [](auto x) { BIO_free(x); })
+        UqSSLOBJECT(BIO_new_mem_buf(s.data(), s.size()))
       {}
 
       UqBIO(const std::vector<uint8_t>& d) :
-        UqSSLOBJECT(
-          BIO_new_mem_buf(d.data(), d.size()), [](auto x) { BIO_free(x); })
+        UqSSLOBJECT(BIO_new_mem_buf(d.data(), d.size()))
       {}
 
-      UqBIO(UqBIO&& b, UqBIO&& next) :
-        UqSSLOBJECT(BIO_push(b, next), [](auto x) { BIO_free_all(x); })
+      UqBIO(UqBIO&& b, UqBIO&& next) : UqSSLOBJECT(BIO_push(b, next))
       {
         b.release();
         next.release();
@@ -240,19 +601,18 @@ namespace didx509
       : public UqSSLOBJECT<ASN1_OBJECT, ASN1_OBJECT_new, ASN1_OBJECT_free>
     {
       UqASN1_OBJECT(const std::string& oid) :
-        UqSSLOBJECT(OBJ_txt2obj(oid.c_str(), 1), ASN1_OBJECT_free)
+        UqSSLOBJECT(OBJ_txt2obj(oid.c_str(), 1))
       {}
 
-      UqASN1_OBJECT(const ASN1_OBJECT* obj) :
-        UqSSLOBJECT(OBJ_dup(obj), ASN1_OBJECT_free, true)
+      /// Owns a duplicate of obj.
+      explicit UqASN1_OBJECT(const ASN1_OBJECT* obj) :
+        UqSSLOBJECT(OBJ_dup(obj), true)
       {}
 
-      UqASN1_OBJECT(int nid) :
-        UqSSLOBJECT(OBJ_nid2obj(nid), ASN1_OBJECT_free, true)
-      {}
+      UqASN1_OBJECT(int nid) : UqSSLOBJECT(OBJ_nid2obj(nid), true) {}
 
       UqASN1_OBJECT(UqASN1_OBJECT&& other) noexcept :
-        UqSSLOBJECT(nullptr, ASN1_OBJECT_free, false)
+        UqSSLOBJECT(nullptr, false)
       {
         p = std::move(other.p);
       }
@@ -274,11 +634,11 @@ namespace didx509
                                    ASN1_OCTET_STRING_free>
     {
       UqASN1_OCTET_STRING(const ASN1_OCTET_STRING* str) :
-        UqSSLOBJECT(ASN1_OCTET_STRING_dup(str), ASN1_OCTET_STRING_free)
+        UqSSLOBJECT(ASN1_OCTET_STRING_dup(str))
       {}
 
       UqASN1_OCTET_STRING(UqASN1_OCTET_STRING&& other) noexcept :
-        UqSSLOBJECT(nullptr, ASN1_OCTET_STRING_free, false)
+        UqSSLOBJECT(nullptr, false)
       {
         p = std::move(other.p);
       }
@@ -304,19 +664,20 @@ namespace didx509
                                 X509_EXTENSION_new,
                                 X509_EXTENSION_free>
     {
-      UqX509_EXTENSION(X509_EXTENSION* ext) :
-        UqSSLOBJECT(X509_EXTENSION_dup(ext), X509_EXTENSION_free, true)
+      /// Owns a duplicate of ext.
+      explicit UqX509_EXTENSION(X509_EXTENSION* ext) :
+        UqSSLOBJECT(X509_EXTENSION_dup(ext), true)
       {}
 
       UqX509_EXTENSION(const UqX509_EXTENSION& ext) :
-        UqSSLOBJECT(X509_EXTENSION_dup(ext), X509_EXTENSION_free, true)
+        UqSSLOBJECT(X509_EXTENSION_dup(ext), true)
       {}
 
       UqX509_EXTENSION(UqX509_EXTENSION&& ext) noexcept :
-        UqSSLOBJECT(ext, X509_EXTENSION_free, true)
+        UqSSLOBJECT(ext.release())
       {}
 
-      [[nodiscard]] UqASN1_OBJECT object() const
+      [[nodiscard]] const ASN1_OBJECT* object() const
       {
         return X509_EXTENSION_get_object(*this);
       }
@@ -330,35 +691,28 @@ namespace didx509
     struct UqGENERAL_NAME
       : public UqSSLOBJECT<GENERAL_NAME, GENERAL_NAME_new, GENERAL_NAME_free>
     {
-      UqGENERAL_NAME(GENERAL_NAME* n) :
-        UqSSLOBJECT(GENERAL_NAME_dup(n), GENERAL_NAME_free)
+      /// Owns a duplicate of n.
+      explicit UqGENERAL_NAME(GENERAL_NAME* n) :
+        UqSSLOBJECT(GENERAL_NAME_dup(n))
       {}
 
       UqGENERAL_NAME(UqGENERAL_NAME&& other) noexcept :
-        UqSSLOBJECT(nullptr, GENERAL_NAME_free, false)
+        UqSSLOBJECT(nullptr, false)
       {
         p = std::move(other.p);
       }
     };
 
     struct UqSUBJECT_ALT_NAME
-      : public UqSSLOBJECT<STACK_OF(GENERAL_NAME), nullptr, nullptr>
+      : public UqSSLOBJECT<STACK_OF(GENERAL_NAME), nullptr, free_general_names>
     {
-      UqSUBJECT_ALT_NAME() :
-        UqSSLOBJECT(sk_GENERAL_NAME_new_null(), [](auto x) {
-          sk_GENERAL_NAME_pop_free(x, GENERAL_NAME_free);
-        })
-      {}
+      UqSUBJECT_ALT_NAME() : UqSSLOBJECT(sk_GENERAL_NAME_new_null()) {}
 
-      UqSUBJECT_ALT_NAME(const UqX509_EXTENSION& ext) :
-        UqSSLOBJECT(
-          nullptr,
-          [](auto x) { sk_GENERAL_NAME_pop_free(x, GENERAL_NAME_free); },
-          false)
+      /// Decodes ext, which is only borrowed.
+      UqSUBJECT_ALT_NAME(X509_EXTENSION* ext) : UqSSLOBJECT(nullptr, false)
       {
-        const UqASN1_OBJECT ext_obj(X509_EXTENSION_get_object(ext));
-        const UqASN1_OBJECT ext_key_obj(NID_subject_alt_name);
-        if (ext_obj != ext_key_obj)
+        if (
+          OBJ_obj2nid(X509_EXTENSION_get_object(ext)) != NID_subject_alt_name)
         {
           throw std::runtime_error("invalid extension type");
         }
@@ -371,8 +725,7 @@ namespace didx509
       }
 
       UqSUBJECT_ALT_NAME(UqSUBJECT_ALT_NAME&& other) noexcept :
-        UqSSLOBJECT(
-          nullptr, [](auto x) { sk_GENERAL_NAME_pop_free(x, GENERAL_NAME_free); })
+        UqSSLOBJECT(nullptr, false)
       {
         p = std::move(other.p);
       }
@@ -382,7 +735,7 @@ namespace didx509
         return sk_GENERAL_NAME_num(*this);
       }
 
-      [[nodiscard]] UqGENERAL_NAME at(size_t i) const
+      [[nodiscard]] const GENERAL_NAME* at(size_t i) const
       {
         if (i >= size())
         {
@@ -398,15 +751,13 @@ namespace didx509
                                     EXTENDED_KEY_USAGE_free>
     {
       UqEXTENDED_KEY_USAGE(EXTENDED_KEY_USAGE* eku) :
-        UqSSLOBJECT(sk_ASN1_OBJECT_dup(eku), EXTENDED_KEY_USAGE_free)
+        UqSSLOBJECT(sk_ASN1_OBJECT_dup(eku))
       {}
 
-      UqEXTENDED_KEY_USAGE(const UqX509_EXTENSION& ext) :
-        UqSSLOBJECT(nullptr, EXTENDED_KEY_USAGE_free, false)
+      /// Decodes ext, which is only borrowed.
+      UqEXTENDED_KEY_USAGE(X509_EXTENSION* ext) : UqSSLOBJECT(nullptr, false)
       {
-        const UqASN1_OBJECT ext_obj = UqASN1_OBJECT(X509_EXTENSION_get_object(ext));
-        const UqASN1_OBJECT ext_key_obj(NID_ext_key_usage);
-        if (ext_obj != ext_key_obj)
+        if (OBJ_obj2nid(X509_EXTENSION_get_object(ext)) != NID_ext_key_usage)
         {
           throw std::runtime_error("invalid extension type");
         }
@@ -419,7 +770,7 @@ namespace didx509
       }
 
       UqEXTENDED_KEY_USAGE(UqEXTENDED_KEY_USAGE&& other) noexcept :
-        UqSSLOBJECT(nullptr, EXTENDED_KEY_USAGE_free, false)
+        UqSSLOBJECT(nullptr, false)
       {
         p = std::move(other.p);
       }
@@ -429,177 +780,739 @@ namespace didx509
         return sk_ASN1_OBJECT_num(*this);
       }
 
-      [[nodiscard]] UqASN1_OBJECT at(size_t i) const
+      [[nodiscard]] const ASN1_OBJECT* at(size_t i) const
       {
         if (i >= size())
         {
           throw std::out_of_range("extended key usage index out of range");
         }
-        return {sk_ASN1_OBJECT_value(*this, i)};
+        return sk_ASN1_OBJECT_value(*this, i);
       }
     };
 
-    struct UqX509;
-
-    struct UqEVP_PKEY
-      : public UqSSLOBJECT<EVP_PKEY, EVP_PKEY_new, EVP_PKEY_free>
+    /// DER content octets of an OBJECT IDENTIFIER (without tag and length),
+    /// stored inline so that encoding and comparing OIDs does not allocate.
+    struct OidBytes
     {
-      UqEVP_PKEY(const UqX509& x509);
+      static constexpr size_t max_size = 64;
 
-      UqEVP_PKEY(const EVP_PKEY* key);
+      std::array<uint8_t, max_size> data{};
+      size_t size = 0;
 
-      UqEVP_PKEY(UqEVP_PKEY&& other) noexcept :
-        UqSSLOBJECT(nullptr, EVP_PKEY_free, false)
+      [[nodiscard]] constexpr std::span<const uint8_t> bytes() const
       {
-        p = std::move(other.p);
+        return {data.data(), size};
       }
+    };
 
-      bool operator==(const UqEVP_PKEY& other) const
-      {
-#if defined(OPENSSL_VERSION_MAJOR) && OPENSSL_VERSION_MAJOR >= 3
-        return EVP_PKEY_eq(*this, other) == 1;
-#else
-        return EVP_PKEY_cmp(*this, other) == 1;
-#endif
-      }
+    /// Encodes a dotted-decimal OID such as "1.3.6.1.5.5.7.3.3" to its DER
+    /// content octets. Returns std::nullopt if the text is not a well-formed
+    /// OID (at least two arcs, no empty arcs or leading zeros, a first arc of
+    /// 0, 1 or 2, and a second arc below 40 unless the first arc is 2).
+    constexpr std::optional<OidBytes> encode_oid(std::string_view dotted)
+    {
+      OidBytes r;
 
-      bool operator!=(const UqEVP_PKEY& other) const
+      auto emit = [&r](uint64_t arc) {
+        uint8_t tmp[10] = {};
+        size_t n = 0;
+        do
+        {
+          tmp[n++] = static_cast<uint8_t>(arc & 0x7F);
+          arc >>= 7;
+        } while (arc != 0);
+        if (r.size + n > OidBytes::max_size)
+        {
+          return false;
+        }
+        while (n > 0)
+        {
+          n--;
+          r.data[r.size++] = static_cast<uint8_t>(tmp[n] | (n > 0 ? 0x80 : 0));
+        }
+        return true;
+      };
+
+      size_t pos = 0;
+      size_t arc_index = 0;
+      uint64_t first = 0;
+      while (pos <= dotted.size())
       {
-        return !(*this == other);
+        const size_t dot = dotted.find('.', pos);
+        const size_t stop = dot == std::string_view::npos ? dotted.size() : dot;
+        if (stop == pos || (stop - pos > 1 && dotted[pos] == '0'))
+        {
+          return std::nullopt;
+        }
+
+        uint64_t arc = 0;
+        for (size_t i = pos; i < stop; i++)
+        {
+          const char c = dotted[i];
+          if (c < '0' || c > '9')
+          {
+            return std::nullopt;
+          }
+          const auto digit = static_cast<uint64_t>(c - '0');
+          if (arc > (std::numeric_limits<uint64_t>::max() - digit) / 10)
+          {
+            return std::nullopt;
+          }
+          arc = arc * 10 + digit;
+        }
+
+        if (arc_index == 0)
+        {
+          if (arc > 2)
+          {
+            return std::nullopt;
+          }
+          first = arc;
+        }
+        else if (arc_index == 1)
+        {
+          if (
+            (first < 2 && arc >= 40) ||
+            arc > std::numeric_limits<uint64_t>::max() - 40 * first)
+          {
+            return std::nullopt;
+          }
+          if (!emit(40 * first + arc))
+          {
+            return std::nullopt;
+          }
+        }
+        else if (!emit(arc))
+        {
+          return std::nullopt;
+        }
+
+        arc_index++;
+        if (dot == std::string_view::npos)
+        {
+          break;
+        }
+        pos = dot + 1;
       }
 
-#if defined(OPENSSL_VERSION_MAJOR) && OPENSSL_VERSION_MAJOR >= 3
-      UqBIGNUM get_bn_param(const char* key_name) const
+      if (arc_index < 2)
       {
-        BIGNUM* bn = nullptr;
-        CHECK1(EVP_PKEY_get_bn_param(*this, key_name, &bn));
-        UqBIGNUM r(bn);
-        BN_free(bn);
-        return r;
+        return std::nullopt;
       }
-#endif
-    };
-
-    struct UqEVP_PKEY_CTX : public UqSSLOBJECT<EVP_PKEY_CTX, nullptr, nullptr>
-    {
-      UqEVP_PKEY_CTX(int nid) :
-        UqSSLOBJECT(EVP_PKEY_CTX_new_id(nid, nullptr), EVP_PKEY_CTX_free)
-      {}
-    };
+      return r;
+    }
 
-    struct UqX509 : public UqSSLOBJECT<X509, X509_new, X509_free>
+    /// Reads one DER TLV with a single-byte tag and a definite length from
+    /// [p, end). On success, advances p past the header and sets tag and len.
+    inline bool der_header(
+      const uint8_t*& p, const uint8_t* end, uint8_t& tag, size_t& len)
     {
-      UqX509(const std::string& pem, bool check_null = true) :
-        UqSSLOBJECT(
-          PEM_read_bio_X509(UqBIO(pem), nullptr, nullptr, nullptr),
-          X509_free,
-          check_null)
-      {}
-
-      UqX509(UqX509&& other) noexcept : UqSSLOBJECT(nullptr, X509_free, false)
+      if (end - p < 2 || (p[0] & 0x1F) == 0x1F)
       {
-        X509* ptr = other;
-        other.release();
-        p.reset(ptr);
+        return false;
       }
-
-      UqX509(X509* x509) : UqSSLOBJECT(x509, X509_free)
+      tag = p[0];
+      const uint8_t first = p[1];
+      p += 2;
+      if (first < 0x80)
       {
-        X509_up_ref(x509);
+        len = first;
       }
-
-      UqX509& operator=(const UqX509& other) noexcept
+      else
       {
-        if (this != &other)
+        const size_t n = first & 0x7F;
+        if (n == 0 || n > sizeof(size_t) || static_cast<size_t>(end - p) < n)
         {
-          X509_up_ref(other);
-          p.reset(other.p.get());
+          return false;
+        }
+        len = 0;
+        for (size_t i = 0; i < n; i++)
+        {
+          len = (len << 8) | *p++;
         }
-        return *this;
       }
+      return len <= static_cast<size_t>(end - p);
+    }
 
-      UqX509& operator=(UqX509&& other) noexcept
+    /// Well-known extension OIDs, as DER content octets.
+    namespace oids
+    {
+      inline constexpr OidBytes subject_alt_name = *encode_oid("2.5.29.17");
+      inline constexpr OidBytes ext_key_usage = *encode_oid("2.5.29.37");
+      inline constexpr OidBytes subject_key_identifier =
+        *encode_oid("2.5.29.14");
+      inline constexpr OidBytes fulcio_issuer =
+        *encode_oid("1.3.6.1.4.1.57264.1.1");
+      /// Arc under which all Fulcio extensions are registered.
+      inline constexpr OidBytes fulcio = *encode_oid("1.3.6.1.4.1.57264.1");
+    }
+
+    /// Index over the extensions of a certificate, built in a single pass.
+    /// Entries borrow the extension objects owned by the certificate, which
+    /// must outlive the index, and are keyed by the OID's content octets.
+    class ExtensionIndex
+    {
+    public:
+      explicit ExtensionIndex(const X509* cert)
       {
-        p = std::move(other.p);
-        return *this;
+        const int count = X509_get_ext_count(cert);
+        entries.reserve(count > 0 ? static_cast<size_t>(count) : 0);
+        for (int i = 0; i < count; i++)
+        {
+          X509_EXTENSION* ext = X509_get_ext(cert, i);
+          const ASN1_OBJECT* obj = X509_EXTENSION_get_object(ext);
+          entries.push_back(
+            {{OBJ_get0_data(obj), OBJ_length(obj)}, ext});
+        }
       }
 
-      [[nodiscard]] bool is_ca() const
+      [[nodiscard]] size_t size() const
       {
-        return X509_check_ca(p.get()) != 0;
+        return entries.size();
       }
 
-      [[nodiscard]] int extension_index(const std::string& oid) const
+      /// Calls f with the OID and extension of every entry, in certificate
+      /// order.
+      template <typename F>
+      void for_each(F&& f) const
       {
-        return X509_get_ext_by_OBJ(*this, UqASN1_OBJECT(oid), -1);
+        for (const auto& e : entries)
+        {
+          f(e.oid, e.ext);
+        }
       }
 
-      template <typename T>
-      [[nodiscard]] std::vector<T> extensions(const UqASN1_OBJECT& obj) const
+      /// Calls f with every extension whose OID is oid, in certificate order.
+      template <typename F>
+      void for_each(const OidBytes& oid, F&& f) const
       {
-        std::vector<T> r;
-        auto count = X509_get_ext_count(*this);
-        int index = -1;
-        do
+        const auto key = oid.bytes();
+        for (const auto& e : entries)
         {
-          index = X509_get_ext_by_OBJ(*this, obj, index);
-          if (index != -1)
+          if (std::ranges::equal(e.oid, key))
           {
-            r.emplace_back(X509_get_ext(*this, index));
+            f(e.ext);
           }
-        } while (index != -1 && index < count);
-        return r;
-      }
-
-      template <typename T>
-      [[nodiscard]] std::vector<T> extensions(const std::string& oid) const
-      {
-        return extensions<T>(UqASN1_OBJECT(oid));
+        }
       }
 
-      [[nodiscard]] std::vector<UqSUBJECT_ALT_NAME> subject_alternative_name() const
+    private:
+      struct Entry
       {
-        return extensions<UqSUBJECT_ALT_NAME>(
-          UqASN1_OBJECT(NID_subject_alt_name));
+        std::span<const uint8_t> oid;
+        X509_EXTENSION* ext;
       };
 
-      [[nodiscard]] std::vector<UqEXTENDED_KEY_USAGE> extended_key_usage() const
-      {
-        return extensions<UqEXTENDED_KEY_USAGE>(
-          UqASN1_OBJECT(NID_ext_key_usage));
-      };
+      std::vector<Entry> entries;
+    };
 
-      [[nodiscard]] bool has_key_usage() const
+    /// A SAN entry borrowed from a decoded subjectAltName extension. For the
+    /// IA5String types (dNSName, rfc822Name, uniformResourceIdentifier) value
+    /// holds the raw bytes, including any embedded NUL; for all other types it
+    /// is a null view.
+    struct SanEntry
+    {
+      int type;
+      std::string_view value;
+    };
+
+    /// Maps a did:x509 SAN type name to the corresponding GEN_* constant.
+    inline int san_gen_type(const std::string& san_type)
+    {
+      if (san_type == "dns")
+      {
+        return GEN_DNS;
+      }
+      if (san_type == "email")
       {
-        return (X509_get_extension_flags(*this) & EXFLAG_KUSAGE) != 0;
+        return GEN_EMAIL;
       }
+      if (san_type == "uri")
+      {
+        return GEN_URI;
+      }
+      throw std::runtime_error(std::string("unknown SAN type: ") + san_type);
+    }
 
-      [[nodiscard]] bool has_key_usage_digital_signature() const
+    /// Non-owning view over all SAN entries of a certificate. Each
+    /// subjectAltName extension is decoded once and its GENERAL_NAMEs are read
+    /// in place instead of being duplicated. Entries remain valid for the
+    /// lifetime of the view.
+    class SanView
+    {
+    public:
+      /// Leaves with at least this many entries get a hash index on the second
+      /// lookup; below it a linear scan is cheaper.
+      static constexpr size_t index_threshold = 32;
+
+      SanView(
+        const X509* cert,
+        size_t max_entries = std::numeric_limits<size_t>::max()) :
+        SanView(ExtensionIndex(cert), max_entries)
+      {}
+
+      SanView(
+        const ExtensionIndex& extensions,
+        size_t max_entries = std::numeric_limits<size_t>::max())
       {
-        return has_key_usage() &&
-          (X509_get_key_usage(*this) & KU_DIGITAL_SIGNATURE) != 0;
+        extensions.for_each(oids::subject_alt_name, [&](X509_EXTENSION* ext) {
+          auto* names =
+            static_cast<STACK_OF(GENERAL_NAME)*>(X509V3_EXT_d2i(ext));
+          if (names == nullptr)
+          {
+            throw std::runtime_error("SAN extension could not be decoded");
+          }
+          stacks.emplace_back(names);
+
+          const auto n = static_cast<size_t>(sk_GENERAL_NAME_num(names));
+          if (n > max_entries - entries.size())
+          {
+            throw std::runtime_error("too many SAN entries");
+          }
+          entries.reserve(entries.size() + n);
+          for (size_t i = 0; i < n; i++)
+          {
+            const auto* name =
+              sk_GENERAL_NAME_value(names, static_cast<int>(i));
+            entries.push_back({name->type, ia5_value(name)});
+          }
+        });
       }
 
-      [[nodiscard]] bool has_key_usage_key_agreement() const
+      [[nodiscard]] size_t size() const
       {
-        return has_key_usage() &&
-          (X509_get_key_usage(*this) & KU_KEY_AGREEMENT) != 0;
+        return entries.size();
       }
 
-      [[nodiscard]] bool has_common_name(const std::string& expected_name) const;
+      [[nodiscard]] std::vector<SanEntry>::const_iterator begin() const
+      {
+        return entries.begin();
+      }
 
-      [[nodiscard]] std::map<std::string, std::vector<std::string>> subject() const
+      [[nodiscard]] std::vector<SanEntry>::const_iterator end() const
       {
-        std::map<std::string, std::vector<std::string>> r;
+        return entries.end();
+      }
 
-        auto * name = X509_get_subject_name(*this);
-        CHECKNULL(name);
-        auto n = X509_NAME_entry_count(name);
-        for (auto i = 0; i < n; i++)
+      /// Builds per-type hash sets over the IA5String entries so that
+      /// subsequent calls to contains() are constant time. The sets borrow the
+      /// entry bytes; nothing is copied.
+      void build_index()
+      {
+        if (indexed)
         {
-          X509_NAME_ENTRY* entry = X509_NAME_get_entry(name, i);
-          CHECKNULL(entry);
-
+          return;
+        }
+        for (const auto& e : entries)
+        {
+          const int slot = slot_of(e.type);
+          if (slot != -1 && e.value.data() != nullptr)
+          {
+            index[slot].insert(e.value);
+          }
+        }
+        indexed = true;
+      }
+
+      /// Exact, length-aware comparison of value against the entries of the
+      /// given GEN_* type.
+      [[nodiscard]] bool contains(int type, std::string_view value)
+      {
+        if (!indexed && lookups++ > 0 && entries.size() >= index_threshold)
+        {
+          build_index();
+        }
+        if (indexed)
+        {
+          const int slot = slot_of(type);
+          return slot != -1 && index[slot].contains(value);
+        }
+        for (const auto& e : entries)
+        {
+          if (
+            e.type == type && e.value.data() != nullptr && e.value == value)
+          {
+            return true;
+          }
+        }
+        return false;
+      }
+
+    private:
+      struct NamesFree
+      {
+        void operator()(STACK_OF(GENERAL_NAME) * names) const
+        {
+          sk_GENERAL_NAME_pop_free(names, GENERAL_NAME_free);
+        }
+      };
+
+      std::vector<std::unique_ptr<STACK_OF(GENERAL_NAME), NamesFree>> stacks;
+      std::vector<SanEntry> entries;
+      std::array<std::unordered_set<std::string_view>, 3> index;
+      size_t lookups = 0;
+      bool indexed = false;
+
+      static int slot_of(int type)
+      {
+        switch (type)
+        {
+          case GEN_DNS:
+            return 0;
+          case GEN_EMAIL:
+            return 1;
+          case GEN_URI:
+            return 2;
+          default:
+            return -1;
+        }
+      }
+
+      static std::string_view ia5_value(const GENERAL_NAME* name)
+      {
+        const ASN1_IA5STRING* ia5 = nullptr;
+        switch (name->type)
+        {
+          case GEN_DNS:
+            ia5 = name->d.dNSName;
+            break;
+          case GEN_EMAIL:
+            ia5 = name->d.rfc822Name;
+            break;
+          case GEN_URI:
+            ia5 = name->d.uniformResourceIdentifier;
+            break;
+          default:
+            break;
+        }
+        if (ia5 == nullptr)
+        {
+          return {};
+        }
+        const int len = ASN1_STRING_length(ia5);
+        const unsigned char* data = ASN1_STRING_get0_data(ia5);
+        if (data == nullptr || len < 0)
+        {
+          return {};
+        }
+        return {(const char*)data, static_cast<size_t>(len)};
+      }
+    };
+
+    /// Non-owning view over the OIDs of all extendedKeyUsage extensions of a
+    /// certificate. The DER of each extension is walked in place and every
+    /// OID is exposed as its content octets, so no ASN1_OBJECTs are created.
+    class EkuView
+    {
+    public:
+      EkuView(
+        const X509* cert,
+        size_t max_entries = std::numeric_limits<size_t>::max()) :
+        EkuView(ExtensionIndex(cert), max_entries)
+      {}
+
+      EkuView(
+        const ExtensionIndex& extensions,
+        size_t max_entries = std::numeric_limits<size_t>::max())
+      {
+        extensions.for_each(oids::ext_key_usage, [&](X509_EXTENSION* ext) {
+          const ASN1_OCTET_STRING* value = X509_EXTENSION_get_data(ext);
+          const uint8_t* p = ASN1_STRING_get0_data(value);
+          const uint8_t* end = p + ASN1_STRING_length(value);
+
+          uint8_t tag = 0;
+          size_t len = 0;
+          if (!der_header(p, end, tag, len) || tag != 0x30 || p + len != end)
+          {
+            throw std::runtime_error(
+              "key usage extension could not be decoded");
+          }
+          while (p < end)
+          {
+            if (
+              !der_header(p, end, tag, len) || tag != 0x06 ||
+              !valid_oid_content(p, len))
+            {
+              throw std::runtime_error(
+                "key usage extension could not be decoded");
+            }
+            if (entries.size() == max_entries)
+            {
+              throw std::runtime_error("too many EKU entries");
+            }
+            entries.emplace_back(p, len);
+            p += len;
+          }
+        });
+      }
+
+      [[nodiscard]] size_t size() const
+      {
+        return entries.size();
+      }
+
+      [[nodiscard]] auto begin() const
+      {
+        return entries.begin();
+      }
+
+      [[nodiscard]] auto end() const
+      {
+        return entries.end();
+      }
+
+      [[nodiscard]] bool contains(const OidBytes& oid) const
+      {
+        const auto needle = oid.bytes();
+        return std::ranges::any_of(entries, [&needle](const auto& o) {
+          return std::ranges::equal(o, needle);
+        });
+      }
+
+    private:
+      std::vector<std::span<const uint8_t>> entries;
+
+      // Mirrors the checks of c2i_ASN1_OBJECT: non-empty, the last octet
+      // terminates a subidentifier, and no subidentifier has a leading 0x80.
+      static bool valid_oid_content(const uint8_t* p, size_t len)
+      {
+        if (len == 0 || (p[len - 1] & 0x80) != 0)
+        {
+          return false;
+        }
+        for (size_t i = 0; i < len; i++)
+        {
+          if (p[i] == 0x80 && (i == 0 || (p[i - 1] & 0x80) == 0))
+          {
+            return false;
+          }
+        }
+        return true;
+      }
+    };
+
+    /// Decodes all Fulcio extensions of a certificate in a single pass over
+    /// its extension index.
+    inline FulcioClaims decode_fulcio_claims(const ExtensionIndex& extensions)
+    {
+      using Member = std::optional<std::string> FulcioClaims::*;
+      struct Field
+      {
+        Member member;
+        bool der;
+      };
+
+      // Indexed by the last arc of the OID; .7 is a SAN otherName type, not
+      // an extension.
+      static constexpr std::array<Field, 23> fields = {{
+        {nullptr, false},
+        {&FulcioClaims::issuer, false},
+        {&FulcioClaims::github_workflow_trigger, false},
+        {&FulcioClaims::github_workflow_sha, false},
+        {&FulcioClaims::github_workflow_name, false},
+        {&FulcioClaims::github_workflow_repository, false},
+        {&FulcioClaims::github_workflow_ref, false},
+        {nullptr, false},
+        {&FulcioClaims::issuer_v2, true},
+        {&FulcioClaims::build_signer_uri, true},
+        {&FulcioClaims::build_signer_digest, true},
+        {&FulcioClaims::runner_environment, true},
+        {&FulcioClaims::source_repository_uri, true},
+        {&FulcioClaims::source_repository_digest, true},
+        {&FulcioClaims::source_repository_ref, true},
+        {&FulcioClaims::source_repository_identifier, true},
+        {&FulcioClaims::source_repository_owner_uri, true},
+        {&FulcioClaims::source_repository_owner_identifier, true},
+        {&FulcioClaims::build_config_uri, true},
+        {&FulcioClaims::build_config_digest, true},
+        {&FulcioClaims::build_trigger, true},
+        {&FulcioClaims::run_invocation_uri, true},
+        {&FulcioClaims::source_repository_visibility_at_signing, true},
+      }};
+
+      const auto prefix = oids::fulcio.bytes();
+      FulcioClaims claims;
+      extensions.for_each(
+        [&](std::span<const uint8_t> oid, X509_EXTENSION* ext) {
+          if (
+            oid.size() != prefix.size() + 1 ||
+            !std::equal(prefix.begin(), prefix.end(), oid.begin()))
+          {
+            return;
+          }
+          const uint8_t arc = oid.back();
+          if (arc >= fields.size() || fields[arc].member == nullptr)
+          {
+            return;
+          }
+
+          auto& value = claims.*(fields[arc].member);
+          if (value)
+          {
+            throw std::runtime_error("duplicate Fulcio extension");
+          }
+
+          const ASN1_OCTET_STRING* data = X509_EXTENSION_get_data(ext);
+          const uint8_t* p = ASN1_STRING_get0_data(data);
+          const uint8_t* end = p + ASN1_STRING_length(data);
+          if (fields[arc].der)
+          {
+            uint8_t tag = 0;
+            size_t len = 0;
+            if (
+              !der_header(p, end, tag, len) || tag != V_ASN1_UTF8STRING ||
+              p + len != end)
+            {
+              throw std::runtime_error("Fulcio extension could not be decoded");
+            }
+          }
+          value.emplace((const char*)p, end - p);
+        });
+      return claims;
+    }
+
+    struct UqX509;
+
+    struct UqEVP_PKEY
+      : public UqSSLOBJECT<EVP_PKEY, EVP_PKEY_new, EVP_PKEY_free>
+    {
+      UqEVP_PKEY(const UqX509& x509);
+
+      UqEVP_PKEY(const EVP_PKEY* key);
+
+      UqEVP_PKEY(UqEVP_PKEY&& other) noexcept : UqSSLOBJECT(nullptr, false)
+      {
+        p = std::move(other.p);
+      }
+
+      bool operator==(const UqEVP_PKEY& other) const
+      {
+#if defined(OPENSSL_VERSION_MAJOR) && OPENSSL_VERSION_MAJOR >= 3
+        return EVP_PKEY_eq(*this, other) == 1;
+#else
+        return EVP_PKEY_cmp(*this, other) == 1;
+#endif
+      }
+
+      bool operator!=(const UqEVP_PKEY& other) const
+      {
+        return !(*this == other);
+      }
+
+#if defined(OPENSSL_VERSION_MAJOR) && OPENSSL_VERSION_MAJOR >= 3
+      UqBIGNUM get_bn_param(const char* key_name) const
+      {
+        BIGNUM* bn = nullptr;
+        CHECK1(EVP_PKEY_get_bn_param(*this, key_name, &bn));
+        UqBIGNUM r(bn);
+        BN_free(bn);
+        return r;
+      }
+#endif
+    };
+
+    struct UqEVP_PKEY_CTX
+      : public UqSSLOBJECT<EVP_PKEY_CTX, nullptr, EVP_PKEY_CTX_free>
+    {
+      UqEVP_PKEY_CTX(int nid) :
+        UqSSLOBJECT(EVP_PKEY_CTX_new_id(nid, nullptr))
+      {}
+    };
+
+    /// Read-only certificate accessors shared by the owning UqX509 and the
+    /// borrowed X509View.
+    template <typename Derived>
+    struct X509Accessors
+    {
+      [[nodiscard]] bool is_ca() const
+      {
+        return X509_check_ca(x509()) != 0;
+      }
+
+      [[nodiscard]] int extension_index(const std::string& oid) const
+      {
+        return X509_get_ext_by_OBJ(x509(), UqASN1_OBJECT(oid), -1);
+      }
+
+      template <typename T>
+      [[nodiscard]] std::vector<T> extensions(const UqASN1_OBJECT& obj) const
+      {
+        std::vector<T> r;
+        auto count = X509_get_ext_count(x509());
+        int index = -1;
+        do
+        {
+          index = X509_get_ext_by_OBJ(x509(), obj, index);
+          if (index != -1)
+          {
+            r.emplace_back(X509_get_ext(x509(), index));
+          }
+        } while (index != -1 && index < count);
+        return r;
+      }
+
+      template <typename T>
+      [[nodiscard]] std::vector<T> extensions(const std::string& oid) const
+      {
+        return extensions<T>(UqASN1_OBJECT(oid));
+      }
+
+      [[nodiscard]] std::vector<UqSUBJECT_ALT_NAME> subject_alternative_name() const
+      {
+        return extensions<UqSUBJECT_ALT_NAME>(
+          UqASN1_OBJECT(NID_subject_alt_name));
+      };
+
+      /// Returns a view over the leaf's EKU OIDs, throwing if there are more
+      /// than max_entries.
+      [[nodiscard]] EkuView eku_view(
+        size_t max_entries = std::numeric_limits<size_t>::max()) const
+      {
+        return {x509(), max_entries};
+      }
+
+      [[nodiscard]] FulcioClaims fulcio_claims() const
+      {
+        return decode_fulcio_claims(ExtensionIndex(x509()));
+      }
+
+      [[nodiscard]] std::vector<UqEXTENDED_KEY_USAGE> extended_key_usage() const
+      {
+        return extensions<UqEXTENDED_KEY_USAGE>(
+          UqASN1_OBJECT(NID_ext_key_usage));
+      };
+
+      [[nodiscard]] bool has_key_usage() const
+      {
+        return (X509_get_extension_flags(x509()) & EXFLAG_KUSAGE) != 0;
+      }
+
+      [[nodiscard]] bool has_key_usage_digital_signature() const
+      {
+        return has_key_usage() &&
+          (X509_get_key_usage(x509()) & KU_DIGITAL_SIGNATURE) != 0;
+      }
+
+      [[nodiscard]] bool has_key_usage_key_agreement() const
+      {
+        return has_key_usage() &&
+          (X509_get_key_usage(x509()) & KU_KEY_AGREEMENT) != 0;
+      }
+
+      [[nodiscard]] bool has_common_name(const std::string& expected_name) const;
+
+      [[nodiscard]] std::map<std::string, std::vector<std::string>> subject() const
+      {
+        std::map<std::string, std::vector<std::string>> r;
+
+        auto * name = X509_get_subject_name(x509());
+        CHECKNULL(name);
+        auto n = X509_NAME_entry_count(name);
+        for (auto i = 0; i < n; i++)
+        {
+          X509_NAME_ENTRY* entry = X509_NAME_get_entry(name, i);
+          CHECKNULL(entry);
+
           ASN1_OBJECT* oid = X509_NAME_ENTRY_get_object(entry);
           CHECKNULL(oid);
 
@@ -677,12 +1590,12 @@ namespace didx509
 
       [[nodiscard]] bool has_subject_key_id() const
       {
-        return X509_get0_subject_key_id(*this) != nullptr;
+        return X509_get0_subject_key_id(x509()) != nullptr;
       }
 
       [[nodiscard]] std::string subject_key_id() const
       {
-        const ASN1_OCTET_STRING* key_id = X509_get0_subject_key_id(*this);
+        const ASN1_OCTET_STRING* key_id = X509_get0_subject_key_id(x509());
         if (key_id == nullptr)
         {
           throw std::runtime_error(
@@ -700,12 +1613,12 @@ namespace didx509
 
       [[nodiscard]] bool has_authority_key_id() const
       {
-        return X509_get0_authority_key_id(*this) != nullptr;
+        return X509_get0_authority_key_id(x509()) != nullptr;
       }
 
       [[nodiscard]] std::string authority_key_id() const
       {
-        const ASN1_OCTET_STRING* key_id = X509_get0_authority_key_id(*this);
+        const ASN1_OCTET_STRING* key_id = X509_get0_authority_key_id(x509());
         if (key_id == nullptr)
         {
           throw std::runtime_error(
@@ -721,8 +1634,18 @@ namespace didx509
         return {c.get()};
       }
 
+      /// Decodes the subjectAltName extensions once and returns a view over
+      /// their entries, throwing if there are more than max_entries.
+      [[nodiscard]] SanView san_view(
+        size_t max_entries = std::numeric_limits<size_t>::max()) const
+      {
+        return {x509(), max_entries};
+      }
+
       [[nodiscard]] bool has_san(
-        const std::string& san_type, const std::string& value) const
+        const std::string& san_type,
+        const std::string& value,
+        size_t max_entries = std::numeric_limits<size_t>::max()) const
       {
         // The did:x509 spec requires the [san_type, san_value] pair to be one
         // of the items in chain[0].extensions.san, i.e. an exact, literal match
@@ -731,96 +1654,33 @@ namespace didx509
         // X509_check_host / X509_check_email, which additionally perform
         // wildcard matching and fall back to the subject DN (CN / emailAddress)
         // when no SAN of the requested type is present.
-        int target_type = 0;
-        if (san_type == "dns")
-        {
-          target_type = GEN_DNS;
-        }
-        else if (san_type == "email")
-        {
-          target_type = GEN_EMAIL;
-        }
-        else if (san_type == "uri")
-        {
-          target_type = GEN_URI;
-        }
-        else
-        {
-          throw std::runtime_error(
-            std::string("unknown SAN type: ") + san_type);
-        }
-
-        auto san_exts = subject_alternative_name();
-        for (const auto& ext : san_exts)
-        {
-          for (size_t i = 0; i < ext.size(); i++)
-          {
-            const auto& san_i = ext.at(i);
-            if (san_i->type != target_type)
-            {
-              continue;
-            }
+        //
+        // Values are compared using their explicit length so that an embedded
+        // NUL byte does not truncate them (which could otherwise be used to
+        // spoof a prefix of a pinned value).
+        const int target_type = san_gen_type(san_type);
+        return san_view(max_entries).contains(target_type, value);
+      }
 
-            // All three supported SAN types (dNSName, rfc822Name,
-            // uniformResourceIdentifier) are stored as IA5Strings.
-            const ASN1_IA5STRING* ia5 = nullptr;
-            switch (target_type)
-            {
-              case GEN_DNS:
-                ia5 = san_i->d.dNSName;
-                break;
-              case GEN_EMAIL:
-                ia5 = san_i->d.rfc822Name;
-                break;
-              case GEN_URI:
-                ia5 = san_i->d.uniformResourceIdentifier;
-                break;
-              default:
-                break;
-            }
-            if (ia5 == nullptr)
-            {
-              continue;
-            }
-
-            // Compare using the explicit length so that an embedded NUL byte
-            // does not truncate the value (which could otherwise be used to
-            // spoof a prefix of a pinned value).
-            const int len = ASN1_STRING_length(ia5);
-            const unsigned char* data = ASN1_STRING_get0_data(ia5);
-            if (data == nullptr || len < 0)
-            {
-              continue;
-            }
-            const std::string san_value{
-              data, data + static_cast<size_t>(len)};
-            if (san_value == value)
-            {
-              return true;
-            }
-          }
-        }
-
-        return false;
-      }
-
-      [[nodiscard]] std::vector<uint8_t> der() const
-      {
-        UqBIO mem;
-        i2d_X509_bio(mem, *this);
-        return mem.to_vector();
-      }
+      [[nodiscard]] std::vector<uint8_t> der() const
+      {
+        UqBIO mem;
+        i2d_X509_bio(mem, x509());
+        return mem.to_vector();
+      }
 
       [[nodiscard]] UqEVP_PKEY public_key() const
       {
-        return X509_get0_pubkey(*this);
+        return X509_get0_pubkey(x509());
       }
 
       [[nodiscard]] std::string public_jwk() const
       {
+        const StageScope stage(Stage::public_jwk);
+
         std::string r = "{";
 
-        UqEVP_PKEY pk = X509_get0_pubkey(*this);
+        UqEVP_PKEY pk = X509_get0_pubkey(x509());
         auto base_id = EVP_PKEY_base_id(pk);
         switch (base_id)
         {
@@ -937,23 +1797,91 @@ namespace didx509
         r += "}";
         return r;
       }
+    protected:
+      [[nodiscard]] X509* x509() const
+      {
+        return static_cast<const Derived&>(*this);
+      }
+    };
+
+    /// A certificate borrowed from its owner, typically a UqSTACK_OF_X509.
+    /// Unlike UqX509 it does not take a reference, so copying it costs no
+    /// atomic refcount update; it must not outlive the owner. Construct a
+    /// UqX509 from it to keep the certificate.
+    class X509View : public X509Accessors<X509View>
+    {
+    public:
+      X509View(X509* x509) : ptr(x509) {}
+
+      operator X509*() const
+      {
+        return ptr;
+      }
+
+    private:
+      X509* ptr;
+    };
+
+    struct UqX509 : public UqSSLOBJECT<X509, X509_new, X509_free>,
+                    public X509Accessors<UqX509>
+    {
+      UqX509(const std::string& pem, bool check_null = true) :
+        UqSSLOBJECT(
+          PEM_read_bio_X509(UqBIO(pem), nullptr, nullptr, nullptr), check_null)
+      {}
+
+      UqX509(UqX509&& other) noexcept : UqSSLOBJECT(nullptr, false)
+      {
+        X509* ptr = other;
+        other.release();
+        p.reset(ptr);
+      }
+
+      UqX509(X509* x509) : UqSSLOBJECT(x509)
+      {
+        X509_up_ref(x509);
+      }
+
+      UqX509(X509View x509) : UqX509(static_cast<X509*>(x509)) {}
+
+      operator X509View() const
+      {
+        return p.get();
+      }
+
+      UqX509& operator=(const UqX509& other) noexcept
+      {
+        if (this != &other)
+        {
+          X509_up_ref(other);
+          p.reset(other.p.get());
+        }
+        return *this;
+      }
+
+      UqX509& operator=(UqX509&& other) noexcept
+      {
+        p = std::move(other.p);
+        return *this;
+      }
     };
 
     UqEVP_PKEY::UqEVP_PKEY(const UqX509& x509) :
-      UqSSLOBJECT(X509_get_pubkey(x509), EVP_PKEY_free)
+      UqSSLOBJECT(X509_get_pubkey(x509))
     {}
 
-    UqEVP_PKEY::UqEVP_PKEY(const EVP_PKEY* key) :
-      UqSSLOBJECT((EVP_PKEY*)key, EVP_PKEY_free)
+    UqEVP_PKEY::UqEVP_PKEY(const EVP_PKEY* key) : UqSSLOBJECT((EVP_PKEY*)key)
     {
       EVP_PKEY_up_ref((EVP_PKEY*)key);
     }
 
-    inline bool UqX509::has_common_name(const std::string& expected_name) const
+    template <typename Derived>
+    inline bool X509Accessors<Derived>::has_common_name(
+      const std::string& expected_name) const
     {
       // X509_get_subject_name and X509_NAME_get_entry return internal pointers
       // that must NOT be freed; use raw pointers (as subject() does).
-      X509_NAME* subject_name = X509_get_subject_name(*this);
+      X509_NAME* subject_name = X509_get_subject_name(x509());
       CHECKNULL(subject_name);
       int cn_i = X509_NAME_get_index_by_NID(subject_name, NID_commonName, -1);
       while (cn_i != -1)
@@ -1030,6 +1958,13 @@ namespace didx509
     struct UqX509_STORE
       : public UqSSLOBJECT<X509_STORE, X509_STORE_new, X509_STORE_free>
     {
+      UqX509_STORE() = default;
+
+      UqX509_STORE(UqX509_STORE&& other) noexcept : UqSSLOBJECT(nullptr, false)
+      {
+        p = std::move(other.p);
+      }
+
       void set_flags(int flags)
       {
         X509_STORE_set_flags(p.get(), flags);
@@ -1046,25 +1981,213 @@ namespace didx509
       }
     };
 
-    struct UqSTACK_OF_X509_INFO
-      : public UqSSLOBJECT<STACK_OF(X509_INFO), nullptr, nullptr>
+    /// Value of each byte as a base64 digit, or -1 if it is not one.
+    constexpr std::array<int8_t, 256> base64_digit_values = [] {
+      std::array<int8_t, 256> r{};
+      for (size_t c = 0; c < r.size(); c++)
+      {
+        r[c] = c >= 'A' && c <= 'Z' ? static_cast<int8_t>(c - 'A') :
+          c >= 'a' && c <= 'z'      ? static_cast<int8_t>(c - 'a' + 26) :
+          c >= '0' && c <= '9'      ? static_cast<int8_t>(c - '0' + 52) :
+          c == '+'                  ? 62 :
+          c == '/'                  ? 63 :
+                                      -1;
+      }
+      return r;
+    }();
+
+    /// Decodes a PEM chain in its canonical form: CERTIFICATE blocks without
+    /// headers, separated only by whitespace, with non-empty base64 lines of
+    /// at most 76 characters. The bodies are decoded into one DER arena and
+    /// their offsets and lengths appended to `blocks`. Returns false on
+    /// anything else.
+    ///
+    /// With `skip_text`, other lines between blocks (such as the comments
+    /// in CA bundles) are skipped too, as long as they do not start another
+    /// kind of PEM block.
+    inline bool decode_pem_certificates(
+      std::string_view pem,
+      std::vector<uint8_t>& arena,
+      std::vector<std::pair<size_t, size_t>>& blocks,
+      bool skip_text = false)
     {
-      UqSTACK_OF_X509_INFO() :
-        UqSSLOBJECT(sk_X509_INFO_new_null(), [](auto x) {
-          sk_X509_INFO_pop_free(x, X509_INFO_free);
-        })
-      {}
+      constexpr std::string_view begin_line = "-----BEGIN CERTIFICATE-----";
+      constexpr std::string_view end_line = "-----END CERTIFICATE-----";
+      constexpr size_t max_line_length = 76;
 
-      UqSTACK_OF_X509_INFO(UqSTACK_OF_X509_INFO&& other) noexcept :
-        UqSSLOBJECT(other, [](auto x) { sk_X509_INFO_pop_free(x, X509_INFO_free); })
+      size_t i = 0;
+      const auto eol = [&]() {
+        if (i < pem.size() && pem[i] == '\n')
+        {
+          i++;
+          return true;
+        }
+        if (i + 1 < pem.size() && pem[i] == '\r' && pem[i + 1] == '\n')
+        {
+          i += 2;
+          return true;
+        }
+        return false;
+      };
+
+      arena.clear();
+      arena.reserve(pem.size() / 4 * 3);
+      while (true)
       {
-        other.release();
+        while (i < pem.size() &&
+               (pem[i] == '\n' || pem[i] == '\r' || pem[i] == ' ' ||
+                pem[i] == '\t'))
+        {
+          i++;
+        }
+        if (i == pem.size())
+        {
+          break;
+        }
+        if (skip_text && !pem.substr(i).starts_with("-----"))
+        {
+          const auto next = pem.find('\n', i);
+          i = next == std::string_view::npos ? pem.size() : next + 1;
+          continue;
+        }
+        if (
+          (i != 0 && pem[i - 1] != '\n') ||
+          pem.substr(i, begin_line.size()) != begin_line)
+        {
+          return false;
+        }
+        i += begin_line.size();
+        if (!eol())
+        {
+          return false;
+        }
+
+        const size_t start = arena.size();
+        uint32_t acc = 0;
+        size_t digits = 0;
+        size_t padding = 0;
+        while (pem.substr(i, end_line.size()) != end_line)
+        {
+          // Padding is only allowed at the end of the last line.
+          if (padding != 0)
+          {
+            return false;
+          }
+          const size_t line_start = i;
+          for (; i < pem.size() && pem[i] != '\r' && pem[i] != '\n'; i++)
+          {
+            if (pem[i] == '=')
+            {
+              padding++;
+              acc <<= 6;
+            }
+            else
+            {
+              const auto v = base64_digit_values[static_cast<uint8_t>(pem[i])];
+              if (v < 0 || padding != 0)
+              {
+                return false;
+              }
+              acc = acc << 6 | static_cast<uint32_t>(v);
+            }
+            if (++digits % 4 == 0)
+            {
+              arena.push_back(static_cast<uint8_t>(acc >> 16));
+              arena.push_back(static_cast<uint8_t>(acc >> 8));
+              arena.push_back(static_cast<uint8_t>(acc));
+              acc = 0;
+            }
+          }
+          const size_t length = i - line_start;
+          if (length == 0 || length > max_line_length || !eol())
+          {
+            return false;
+          }
+        }
+        if (digits == 0 || digits % 4 != 0 || padding > 2)
+        {
+          return false;
+        }
+        arena.resize(arena.size() - padding);
+        i += end_line.size();
+        if (i != pem.size() && !eol())
+        {
+          return false;
+        }
+        blocks.emplace_back(start, arena.size() - start);
+      }
+
+      return !blocks.empty();
+    }
+
+    /// Reads a PEM chain in the canonical form accepted by
+    /// decode_pem_certificates, parsing each certificate with d2i_X509.
+    /// Returns false on anything else, in which case out may hold some of
+    /// the certificates and the caller should fall back to
+    /// PEM_X509_INFO_read_bio, which then decides whether the input is
+    /// acceptable.
+    ///
+    /// The DER arena is kept in `arena` so that its storage can be reused
+    /// across calls.
+    inline bool read_pem_certificates(
+      std::string_view pem, STACK_OF(X509) * out, std::vector<uint8_t>& arena)
+    {
+      std::vector<std::pair<size_t, size_t>> blocks;
+      if (!decode_pem_certificates(pem, arena, blocks))
+      {
+        return false;
+      }
+      for (const auto& [offset, length] : blocks)
+      {
+        const unsigned char* der = arena.data() + offset;
+        X509* x509 = d2i_X509(nullptr, &der, static_cast<long>(length));
+        if (x509 == nullptr)
+        {
+          return false;
+        }
+        if (sk_X509_push(out, x509) == 0)
+        {
+          X509_free(x509);
+          return false;
+        }
+      }
+      return true;
+    }
+
+    inline bool read_pem_certificates(
+      std::string_view pem, STACK_OF(X509) * out)
+    {
+      std::vector<uint8_t> arena;
+      return read_pem_certificates(pem, out, arena);
+    }
+
+    /// Splits buffer at offsets: element i is [offsets[i], offsets[i + 1]).
+    inline std::vector<std::string_view> pem_slices(
+      std::string_view buffer, std::span<const size_t> offsets)
+    {
+      std::vector<std::string_view> r;
+      for (size_t i = 0; i + 1 < offsets.size(); i++)
+      {
+        if (offsets[i] > offsets[i + 1] || offsets[i + 1] > buffer.size())
+        {
+          throw std::out_of_range("invalid PEM element offsets");
+        }
+        r.push_back(buffer.substr(offsets[i], offsets[i + 1] - offsets[i]));
       }
+      return r;
+    }
+
+    struct UqSTACK_OF_X509_INFO
+      : public UqSSLOBJECT<STACK_OF(X509_INFO), nullptr, free_x509_infos>
+    {
+      UqSTACK_OF_X509_INFO() : UqSSLOBJECT(sk_X509_INFO_new_null()) {}
+
+      UqSTACK_OF_X509_INFO(UqSTACK_OF_X509_INFO&& other) noexcept :
+        UqSSLOBJECT(other.release())
+      {}
 
       UqSTACK_OF_X509_INFO(const UqBIO& bio) :
-        UqSSLOBJECT(
-          PEM_X509_INFO_read_bio(bio, nullptr, nullptr, nullptr),
-          [](auto x) { sk_X509_INFO_pop_free(x, X509_INFO_free); })
+        UqSSLOBJECT(PEM_X509_INFO_read_bio(bio, nullptr, nullptr, nullptr))
       {
         if (p == nullptr)
         {
@@ -1079,29 +2202,28 @@ namespace didx509
     };
 
     struct UqSTACK_OF_X509
-      : public UqSSLOBJECT<STACK_OF(X509), nullptr, nullptr>
+      : public UqSSLOBJECT<STACK_OF(X509), nullptr, free_x509s>
     {
-      UqSTACK_OF_X509() :
-        UqSSLOBJECT(
-          sk_X509_new_null(), [](auto x) { sk_X509_pop_free(x, X509_free); })
-      {}
+      UqSTACK_OF_X509() : UqSSLOBJECT(sk_X509_new_null()) {}
 
       UqSTACK_OF_X509(const UqX509_STORE_CTX& ctx) :
-        UqSSLOBJECT(X509_STORE_CTX_get1_chain(ctx), [](auto x) {
-          sk_X509_pop_free(x, X509_free);
-        })
+        UqSSLOBJECT(X509_STORE_CTX_get1_chain(ctx))
       {}
 
       UqSTACK_OF_X509(UqSTACK_OF_X509&& other) noexcept :
-        UqSSLOBJECT(other, [](auto x) { sk_X509_pop_free(x, X509_free); })
-      {
-        other.release();
-      }
+        UqSSLOBJECT(other.release())
+      {}
 
-      UqSTACK_OF_X509(const std::string& pem) :
-        UqSSLOBJECT(
-          nullptr, [](auto x) { sk_X509_pop_free(x, X509_free); }, false)
+      UqSTACK_OF_X509(const std::string& pem, const Limits& limits = {}) :
+        UqSSLOBJECT(nullptr, false)
       {
+        const StageScope stage(Stage::parse_pem);
+        check_pem_limits(pem, limits);
+        p.reset(sk_X509_new_null());
+        if (read_fast(pem))
+        {
+          return;
+        }
         const UqBIO mem(pem);
         UqSTACK_OF_X509_INFO sk_info(mem);
         p.reset(sk_X509_new_null());
@@ -1117,27 +2239,20 @@ namespace didx509
         }
       }
 
-      UqSTACK_OF_X509(const std::vector<std::string>& pem) :
-        UqSSLOBJECT(
-          nullptr, [](auto x) { sk_X509_pop_free(x, X509_free); }, false)
+      UqSTACK_OF_X509(
+        const std::vector<std::string>& pem, const Limits& limits = {}) :
+        UqSSLOBJECT(nullptr, false)
       {
-        p.reset(sk_X509_new_null());
-        for (const auto& pem_elem: pem)
-        {
-          const UqBIO mem(pem_elem);
-          UqSTACK_OF_X509_INFO sk_info(mem);
-          if (sk_info.size() != 1)
-          {
-            throw std::runtime_error("expected exactly one PEM element");
-          }
-          auto * sk_0 = sk_X509_INFO_value(sk_info, 0);
-          if (sk_0->x509 == nullptr)
-          {
-            throw std::runtime_error("invalid PEM element");
-          }
-          X509_up_ref(sk_0->x509);
-          sk_X509_push(*this, sk_0->x509);
-        }
+        read_elements(pem, limits);
+      }
+
+      /// Reads one certificate from each element, e.g. from slices of a
+      /// received message, without copying them into separate strings.
+      UqSTACK_OF_X509(
+        std::span<const std::string_view> pem, const Limits& limits = {}) :
+        UqSSLOBJECT(nullptr, false)
+      {
+        read_elements(pem, limits);
       }
 
       UqSTACK_OF_X509& operator=(UqSTACK_OF_X509&& other) noexcept
@@ -1157,7 +2272,8 @@ namespace didx509
         return size() == 0;
       }
 
-      [[nodiscard]] UqX509 at(size_t i) const
+      /// Borrows certificate i; the view is valid as long as this stack.
+      [[nodiscard]] X509View at(size_t i) const
       {
         if (i >= size())
         {
@@ -1177,12 +2293,12 @@ namespace didx509
         sk_X509_push(p.get(), x509.release());
       }
 
-      [[nodiscard]] UqX509 front() const
+      [[nodiscard]] X509View front() const
       {
         return (*this).at(0);
       }
 
-      [[nodiscard]] UqX509 back() const
+      [[nodiscard]] X509View back() const
       {
         return (*this).at(size() - 1);
       }
@@ -1190,20 +2306,173 @@ namespace didx509
       [[nodiscard]] UqSTACK_OF_X509 verify(
         const std::vector<UqX509>& roots,
         bool ignore_time = false,
-        bool no_auth_key_id_ok = true) const
+        bool no_auth_key_id_ok = true,
+        const Limits& limits = {}) const
+      {
+        StageScope stage(Stage::verify_chain);
+        check_length(limits);
+        return verify_with(
+          stage,
+          make_store(roots),
+          ignore_time,
+          std::nullopt,
+          no_auth_key_id_ok,
+          limits);
+      }
+
+      /// Verifies the chain as it would have been verified at time `at`, e.g.
+      /// to check whether a historical signature was valid when it was made.
+      [[nodiscard]] UqSTACK_OF_X509 verify(
+        const std::vector<UqX509>& roots,
+        std::chrono::system_clock::time_point at,
+        bool no_auth_key_id_ok = true,
+        const Limits& limits = {}) const
+      {
+        StageScope stage(Stage::verify_chain);
+        check_length(limits);
+        return verify_with(
+          stage, make_store(roots), false, at, no_auth_key_id_ok, limits);
+      }
+
+      /// As above, but against a prebuilt store of trusted roots, so that many
+      /// verifications can share one store (see make_store()).
+      [[nodiscard]] UqSTACK_OF_X509 verify(
+        const UqX509_STORE& store,
+        bool ignore_time = false,
+        bool no_auth_key_id_ok = true,
+        const Limits& limits = {}) const
+      {
+        StageScope stage(Stage::verify_chain);
+        check_length(limits);
+        return verify_with(
+          stage, store, ignore_time, std::nullopt, no_auth_key_id_ok, limits);
+      }
+
+      [[nodiscard]] UqSTACK_OF_X509 verify(
+        const UqX509_STORE& store,
+        std::chrono::system_clock::time_point at,
+        bool no_auth_key_id_ok = true,
+        const Limits& limits = {}) const
+      {
+        StageScope stage(Stage::verify_chain);
+        check_length(limits);
+        return verify_with(stage, store, false, at, no_auth_key_id_ok, limits);
+      }
+
+      static UqX509_STORE make_store(const std::vector<UqX509>& roots)
+      {
+        UqX509_STORE store;
+        for (const auto& c : roots)
+        {
+          CHECK1(X509_STORE_add_cert(store, c));
+        }
+        return store;
+      }
+
+    private:
+      void check_length(const Limits& limits) const
       {
         if (size() <= 1)
         {
           throw std::runtime_error("certificate chain too short");
         }
+        if (size() > limits.max_certificates)
+        {
+          throw std::runtime_error("too many certificates");
+        }
+      }
 
-        UqX509_STORE store;
+      // Appends the certificates of a canonical PEM chain, leaving the
+      // OpenSSL error queue as it was; see read_pem_certificates.
+      bool read_fast(std::string_view pem, std::vector<uint8_t>& arena)
+      {
+        ERR_set_mark();
+        const bool ok = read_pem_certificates(pem, p.get(), arena);
+        ERR_pop_to_mark();
+        return ok;
+      }
 
-        for (const auto& c : roots)
+      bool read_fast(std::string_view pem)
+      {
+        std::vector<uint8_t> arena;
+        return read_fast(pem, arena);
+      }
+
+      // Reads exactly one certificate from each element. All elements share
+      // one DER arena; only elements the fast reader rejects get a BIO.
+      template <typename Elements>
+      void read_elements(const Elements& pem, const Limits& limits)
+      {
+        const StageScope stage(Stage::parse_pem);
+        if (pem.size() > limits.max_certificates)
         {
-          CHECK1(X509_STORE_add_cert(store, c));
+          throw std::runtime_error("too many certificates");
+        }
+        size_t total = 0;
+        for (const auto& pem_elem : pem)
+        {
+          total += pem_elem.size();
+        }
+        if (total > limits.max_pem_bytes)
+        {
+          throw std::runtime_error("PEM input too large");
+        }
+        p.reset(sk_X509_new_null());
+        std::vector<uint8_t> arena;
+        for (const auto& pem_elem : pem)
+        {
+          const size_t before = size();
+          if (read_fast(pem_elem, arena) && size() == before + 1)
+          {
+            continue;
+          }
+          while (size() > before)
+          {
+            X509_free(sk_X509_pop(p.get()));
+          }
+          const UqBIO mem(pem_elem.data(), static_cast<int>(pem_elem.size()));
+          UqSTACK_OF_X509_INFO sk_info(mem);
+          if (sk_info.size() != 1)
+          {
+            throw std::runtime_error("expected exactly one PEM element");
+          }
+          auto * sk_0 = sk_X509_INFO_value(sk_info, 0);
+          if (sk_0->x509 == nullptr)
+          {
+            throw std::runtime_error("invalid PEM element");
+          }
+          X509_up_ref(sk_0->x509);
+          sk_X509_push(*this, sk_0->x509);
+        }
+      }
+
+      static void check_pem_limits(const std::string& pem, const Limits& limits)
+      {
+        if (pem.size() > limits.max_pem_bytes)
+        {
+          throw std::runtime_error("PEM input too large");
+        }
+        // Count PEM blocks without parsing them; every certificate needs one.
+        const std::string_view marker = "-----BEGIN ";
+        size_t blocks = 0;
+        for (size_t pos = pem.find(marker); pos != std::string::npos;
+             pos = pem.find(marker, pos + marker.size()))
+        {
+          if (++blocks > limits.max_certificates)
+          {
+            throw std::runtime_error("too many certificates");
+          }
         }
+      }
 
+      [[nodiscard]] UqSTACK_OF_X509 verify_with(
+        StageScope& stage,
+        const UqX509_STORE& store,
+        bool ignore_time,
+        std::optional<std::chrono::system_clock::time_point> time,
+        bool no_auth_key_id_ok,
+        const Limits& limits) const
+      {
         auto target = at(0);
 
         UqX509_STORE_CTX store_ctx;
@@ -1215,7 +2484,10 @@ namespace didx509
           param_holder(X509_VERIFY_PARAM_new(), X509_VERIFY_PARAM_free);
         CHECKNULL(param_holder.get());
         X509_VERIFY_PARAM* param = param_holder.get();
-        X509_VERIFY_PARAM_set_depth(param, std::numeric_limits<int>::max());
+        X509_VERIFY_PARAM_set_depth(
+          param,
+          static_cast<int>(std::min<size_t>(
+            limits.max_certificates, std::numeric_limits<int>::max())));
         // Require at least 112-bit-equivalent security (OpenSSL level 2):
         // RSA/DSA/DH keys >= 2048 bits, ECC keys >= 224 bits, no RC4 or MD5.
         // See https://docs.openssl.org/master/man3/SSL_CTX_set_security_level/
@@ -1230,6 +2502,11 @@ namespace didx509
         {
           CHECK1(X509_VERIFY_PARAM_set_flags(param, X509_V_FLAG_NO_CHECK_TIME));
         }
+        else if (time.has_value())
+        {
+          X509_VERIFY_PARAM_set_time(
+            param, std::chrono::system_clock::to_time_t(*time));
+        }
 
         // set0 takes ownership of param, so release it from the unique_ptr.
         X509_STORE_CTX_set0_param(store_ctx, param_holder.release());
@@ -1261,6 +2538,7 @@ namespace didx509
           const int err_code = X509_STORE_CTX_get_error(store_ctx);
           const int depth = X509_STORE_CTX_get_error_depth(store_ctx);
           const char* err_str = X509_verify_cert_error_string(err_code);
+          stage.fail(ErrorCategory::chain_verification, err_code);
           throw std::runtime_error(
             std::string("certificate chain verification failed: ") + err_str +
             " (depth: " + std::to_string(depth) + ")");
@@ -1271,10 +2549,54 @@ namespace didx509
       }
     };
 
-    inline std::vector<uint8_t> sha256(const std::vector<uint8_t>& message)
+    /// The SHA-2 digests used during resolution. With OpenSSL 3 they are
+    /// fetched once from the default library context: passing the legacy
+    /// EVP_sha256() etc. to EVP_DigestInit_ex() looks the implementation up
+    /// again on every call.
+    class Digests
     {
-      UqEVP_MD_CTX ctx;
-      ctx.init(EVP_sha256());
+    public:
+      const EVP_MD* sha256 = EVP_sha256();
+      const EVP_MD* sha384 = EVP_sha384();
+      const EVP_MD* sha512 = EVP_sha512();
+
+      Digests()
+      {
+#if defined(OPENSSL_VERSION_MAJOR) && OPENSSL_VERSION_MAJOR >= 3
+        ERR_set_mark();
+        fetch(sha256, "SHA2-256", 0);
+        fetch(sha384, "SHA2-384", 1);
+        fetch(sha512, "SHA2-512", 2);
+        ERR_pop_to_mark();
+#endif
+      }
+
+      static const Digests& get()
+      {
+        static const Digests digests;
+        return digests;
+      }
+
+#if defined(OPENSSL_VERSION_MAJOR) && OPENSSL_VERSION_MAJOR >= 3
+    private:
+      // Keeps the legacy digest if the fetch fails.
+      void fetch(const EVP_MD*& md, const char* name, size_t i)
+      {
+        fetched[i].reset(EVP_MD_fetch(nullptr, name, nullptr));
+        if (fetched[i])
+        {
+          md = fetched[i].get();
+        }
+      }
+
+      std::array<std::unique_ptr<EVP_MD, SSLDeleter<EVP_MD_free>>, 3> fetched;
+#endif
+    };
+
+    inline std::vector<uint8_t> sha256(const std::vector<uint8_t>& message)
+    {
+      UqEVP_MD_CTX ctx;
+      ctx.init(Digests::get().sha256);
       ctx.update(message);
       return ctx.final();
     }
@@ -1282,7 +2604,7 @@ namespace didx509
     inline std::vector<uint8_t> sha384(const std::vector<uint8_t>& message)
     {
       UqEVP_MD_CTX ctx;
-      ctx.init(EVP_sha384());
+      ctx.init(Digests::get().sha384);
       ctx.update(message);
       return ctx.final();
     }
@@ -1290,84 +2612,212 @@ namespace didx509
     inline std::vector<uint8_t> sha512(const std::vector<uint8_t>& message)
     {
       UqEVP_MD_CTX ctx;
-      ctx.init(EVP_sha512());
+      ctx.init(Digests::get().sha512);
       ctx.update(message);
       return ctx.final();
     }
 
-    inline void check_fingerprint(
-      const UqSTACK_OF_X509& chain,
-      const std::string& fingerprint_alg,
-      const std::string& fingerprint)
+    using HashFunction = std::vector<uint8_t> (*)(const std::vector<uint8_t>&);
+
+    /// The cache slot and hash function of a supported fingerprint
+    /// algorithm, or a null function if it is not supported.
+    inline std::pair<size_t, HashFunction> fingerprint_algorithm(
+      const std::string& fingerprint_alg)
     {
-      for (size_t i = 1; i < chain.size(); i++)
+      if (fingerprint_alg == "sha256")
+      {
+        return {0, sha256};
+      }
+      if (fingerprint_alg == "sha384")
+      {
+        return {1, sha384};
+      }
+      if (fingerprint_alg == "sha512")
       {
-        const auto& cert = chain.at(i).der();
+        return {2, sha512};
+      }
+      return {0, nullptr};
+    }
+
+    /// Base64url fingerprints of a chain's CA certificates, computed on
+    /// demand and cached per algorithm, so that checking several DIDs against
+    /// one chain encodes and hashes each CA certificate at most once per
+    /// algorithm.
+    class FingerprintCache
+    {
+    public:
+      explicit FingerprintCache(const UqSTACK_OF_X509& chain) : chain(chain) {}
+
+      /// Throws unless one of the CA certificates (all but the leaf) has the
+      /// given fingerprint.
+      void check(
+        const std::string& fingerprint_alg, const std::string& fingerprint)
+      {
+        StageScope stage(Stage::check_fingerprint);
 
-        std::vector<uint8_t> hash;
-        if (fingerprint_alg == "sha256")
+        for (size_t i = 1; i < chain.size(); i++)
         {
-          hash = sha256(cert);
+          const std::string* b64 = fingerprint_of(fingerprint_alg, i);
+          if (b64 == nullptr)
+          {
+            stage.fail(ErrorCategory::unsupported_fingerprint_algorithm);
+            throw std::runtime_error("unsupported fingerprint algorithm");
+          }
+
+          if (fingerprint == *b64)
+          {
+            return;
+          }
         }
-        else if (fingerprint_alg == "sha384")
+
+        stage.fail(ErrorCategory::fingerprint_mismatch);
+        throw std::runtime_error("invalid certificate fingerprint");
+      }
+
+      /// The base64url fingerprint of certificate i, or nullptr if the
+      /// algorithm is not supported.
+      const std::string* fingerprint_of(
+        const std::string& fingerprint_alg, size_t i)
+      {
+        const auto [slot, hash] = fingerprint_algorithm(fingerprint_alg);
+        if (hash == nullptr)
         {
-          hash = sha384(cert);
+          return nullptr;
         }
-        else if (fingerprint_alg == "sha512")
+
+        auto& cache = fingerprints[slot];
+        if (cache.size() < chain.size())
         {
-          hash = sha512(cert);
+          cache.resize(chain.size());
         }
-        else
+        if (!cache[i])
         {
-          throw std::runtime_error("unsupported fingerprint algorithm");
+          cache[i] = to_base64url(hash(der(i)));
         }
+        return &*cache[i];
+      }
+
+    private:
+      const UqSTACK_OF_X509& chain;
+      std::vector<std::vector<uint8_t>> ders;
+      std::array<std::vector<std::optional<std::string>>, 3> fingerprints;
 
-        auto b64 = to_base64url(hash);
-        if (fingerprint == b64)
+      const std::vector<uint8_t>& der(size_t i)
+      {
+        if (ders.size() < chain.size())
         {
-          return;
+          ders.resize(chain.size());
+        }
+        if (ders[i].empty())
+        {
+          ders[i] = chain.at(i).der();
         }
+        return ders[i];
       }
+    };
 
-      throw std::runtime_error("invalid certificate fingerprint");
+    inline void check_fingerprint(
+      const UqSTACK_OF_X509& chain,
+      const std::string& fingerprint_alg,
+      const std::string& fingerprint)
+    {
+      FingerprintCache(chain).check(fingerprint_alg, fingerprint);
     }
 
-    inline bool is_hex_digit(char digit)
+    /// Value of each byte as a hex digit, or -1 if it is not one.
+    constexpr std::array<int8_t, 256> hex_digit_values = [] {
+      std::array<int8_t, 256> r{};
+      for (size_t c = 0; c < r.size(); c++)
+      {
+        r[c] = c >= '0' && c <= '9' ? static_cast<int8_t>(c - '0') :
+          c >= 'A' && c <= 'F'      ? static_cast<int8_t>(c - 'A' + 10) :
+          c >= 'a' && c <= 'f'      ? static_cast<int8_t>(c - 'a' + 10) :
+                                      -1;
+      }
+      return r;
+    }();
+
+    /// Decodes %XX escapes in is. A '%' that is not followed by two hex
+    /// digits is kept as is. When is contains no '%' it is returned
+    /// unchanged without copying; otherwise the result is written to
+    /// buffer and the returned view refers to it.
+    inline std::string_view url_unescape(
+      std::string_view is, std::string& buffer)
     {
-      return (digit >= 0x30 && digit <= 0x39) ||
-        (digit >= 0x41 && digit <= 0x46) || (digit >= 0x61 && digit <= 0x66);
+      const char* p = is.data();
+      const char* const end = p + is.size();
+      const auto* pct = static_cast<const char*>(
+        is.empty() ? nullptr : std::memchr(p, '%', is.size()));
+      if (pct == nullptr)
+      {
+        return is;
+      }
+
+      buffer.clear();
+      buffer.reserve(is.size());
+      while (pct != nullptr)
+      {
+        buffer.append(p, pct);
+        p = pct + 1;
+        if (end - pct >= 3)
+        {
+          const auto hi = hex_digit_values[static_cast<uint8_t>(pct[1])];
+          const auto lo = hex_digit_values[static_cast<uint8_t>(pct[2])];
+          if (hi >= 0 && lo >= 0)
+          {
+            buffer.push_back(static_cast<char>(hi << 4 | lo));
+            p = pct + 3;
+          }
+          else
+          {
+            buffer.push_back('%');
+          }
+        }
+        else
+        {
+          buffer.push_back('%');
+        }
+        pct = static_cast<const char*>(
+          p == end ? nullptr : std::memchr(p, '%', end - p));
+      }
+      buffer.append(p, end);
+      return buffer;
     }
 
-    // Adapted from curl:
-    // https://github.com/curl/curl/blob/e335d778e3eaa41ebbe209e9b8110e8a0d9a72f3/lib/escape.c#L134
     inline std::string url_unescape(const std::string& is)
     {
-      std::string r;
+      std::string buffer;
+      const auto r = url_unescape(is, buffer);
+      return r.data() == buffer.data() ? std::move(buffer) : std::string(r);
+    }
+
+    /// Whether c may appear unescaped in a did:x509 value (idchar in the
+    /// did:x509 ABNF, apart from pct-encoded).
+    constexpr bool is_idchar(char c)
+    {
+      return (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z') ||
+        (c >= '0' && c <= '9') || c == '-' || c == '.' || c == '_';
+    }
 
-      const char* string = is.data();
-      for (size_t i = 0; i < is.size(); i++)
+    /// Percent-encodes every byte of s that is not an idchar, using
+    /// upper-case hex digits; the inverse of url_unescape.
+    inline void percent_encode(std::string_view s, std::string& out)
+    {
+      static constexpr char hex[] = "0123456789ABCDEF";
+      for (const char c : s)
       {
-        if (
-          is[i] == '%' && i + 2 < is.size() && is_hex_digit(is[i + 1]) &&
-          is_hex_digit(is[i + 2]))
-        {
-          /* this is two hexadecimal digits following a '%' */
-          char hexstr[3];
-          char *ptr = nullptr;
-          hexstr[0] = is[i + 1];
-          hexstr[1] = is[i + 2];
-          hexstr[2] = 0;
-          const char c = (char)strtoul(hexstr, &ptr, 16);
-          r.push_back(c);
-          i += 2;
+        if (is_idchar(c))
+        {
+          out.push_back(c);
         }
         else
         {
-          r.push_back(is[i]);
+          const auto b = static_cast<unsigned char>(c);
+          out.push_back('%');
+          out.push_back(hex[b >> 4]);
+          out.push_back(hex[b & 0x0F]);
         }
       }
-
-      return r;
     }
 
     inline std::vector<std::string> url_unescape(
@@ -1399,7 +2849,145 @@ namespace didx509
       return r;
     }
 
-    inline void verify(const UqSTACK_OF_X509& chain, const std::string& did)
+    inline void check_did_limits(const std::string& did, const Limits& limits)
+    {
+      if (did.size() > limits.max_did_bytes)
+      {
+        throw std::runtime_error("DID too long");
+      }
+      size_t policies = 0;
+      for (size_t pos = did.find("::"); pos != std::string::npos;
+           pos = did.find("::", pos + 2))
+      {
+        if (++policies > limits.max_policies)
+        {
+          throw std::runtime_error("too many policies");
+        }
+      }
+    }
+
+    /// State about the leaf certificate that is shared by all policies of a
+    /// DID. The extension index, decoded SANs and Fulcio claims are built on
+    /// first use, so the leaf's extensions are walked at most once per
+    /// resolution.
+    class LeafContext
+    {
+    public:
+      explicit LeafContext(X509View leaf) : leaf(leaf) {}
+
+      [[nodiscard]] X509View cert() const
+      {
+        return leaf;
+      }
+
+      [[nodiscard]] const ExtensionIndex& extensions()
+      {
+        if (!index)
+        {
+          index.emplace(leaf);
+        }
+        return *index;
+      }
+
+      [[nodiscard]] SanView& sans(size_t max_entries)
+      {
+        if (!san_view)
+        {
+          san_view.emplace(extensions(), max_entries);
+        }
+        return *san_view;
+      }
+
+      /// Raw values of the leaf's (v1) Fulcio issuer extensions. They are
+      /// read on their own rather than through decode_fulcio_claims(), so a
+      /// malformed or duplicated unrelated Fulcio extension does not affect
+      /// the fulcio-issuer policy.
+      [[nodiscard]] const std::vector<std::string_view>& fulcio_issuers()
+      {
+        if (!issuers)
+        {
+          issuers.emplace();
+          extensions().for_each(
+            oids::fulcio_issuer, [this](X509_EXTENSION* ext) {
+              const ASN1_OCTET_STRING* data = X509_EXTENSION_get_data(ext);
+              issuers->emplace_back(
+                (const char*)ASN1_STRING_get0_data(data),
+                ASN1_STRING_length(data));
+            });
+        }
+        return *issuers;
+      }
+
+      /// Whether a Fulcio issuer extension is https:// followed by `value`.
+      [[nodiscard]] bool has_fulcio_issuer(std::string_view value)
+      {
+        constexpr std::string_view scheme = "https://";
+        return std::ranges::any_of(
+          fulcio_issuers(), [value, scheme](std::string_view issuer) {
+            return issuer.starts_with(scheme) &&
+              issuer.substr(scheme.size()) == value;
+          });
+      }
+
+    private:
+      X509View leaf;
+      std::optional<ExtensionIndex> index;
+      std::optional<SanView> san_view;
+      std::optional<std::vector<std::string_view>> issuers;
+    };
+
+    /// State about a chain that is shared by all DIDs checked against it: the
+    /// CA fingerprints and, once a policy needs it, the leaf.
+    class ChainContext
+    {
+    public:
+      explicit ChainContext(const UqSTACK_OF_X509& chain) :
+        chain(chain),
+        fingerprints(chain)
+      {}
+
+      void check_fingerprint(
+        const std::string& fingerprint_alg, const std::string& fingerprint)
+      {
+        fingerprints.check(fingerprint_alg, fingerprint);
+      }
+
+      [[nodiscard]] const UqSTACK_OF_X509& certificates() const
+      {
+        return chain;
+      }
+
+      [[nodiscard]] FingerprintCache& fingerprint_cache()
+      {
+        return fingerprints;
+      }
+
+      [[nodiscard]] LeafContext& leaf()
+      {
+        if (!leaf_context)
+        {
+          leaf_context.emplace(chain.at(0));
+        }
+        return *leaf_context;
+      }
+
+    private:
+      const UqSTACK_OF_X509& chain;
+      FingerprintCache fingerprints;
+      std::optional<LeafContext> leaf_context;
+    };
+
+    /// A did:x509 DID split into its CA fingerprint and its policies. Only the
+    /// method prefix is validated here; each policy is validated when it is
+    /// evaluated, so that errors surface in the order the policies appear.
+    struct ParsedDid
+    {
+      std::string fingerprint_alg;
+      std::string fingerprint;
+      std::vector<std::string> policies;
+    };
+
+    inline ParsedDid parse_did(const std::string& did)
     {
       auto top_tokens = split(did, "::");
 
@@ -1423,152 +3011,92 @@ namespace didx509
         throw std::runtime_error("unsupported did:x509 version");
       }
 
-      // Check fingerprint
-      const auto& ca_fingerprint_alg = pretokens[3];
-      const auto& ca_fingerprint = pretokens[4];
+      return {
+        std::move(pretokens[3]),
+        std::move(pretokens[4]),
+        std::vector<std::string>(
+          std::make_move_iterator(top_tokens.begin() + 1),
+          std::make_move_iterator(top_tokens.end()))};
+    }
 
-      check_fingerprint(chain, ca_fingerprint_alg, ca_fingerprint);
+    /// Validates and evaluates a single policy against the leaf, throwing if
+    /// it is malformed or not satisfied.
+    inline void check_policy(
+      LeafContext& leaf, const std::string& policy, const Limits& limits)
+    {
+      auto parts = split(policy, ":");
 
-      // Check policies
-      for (size_t i = 1; i < top_tokens.size(); i++)
+      if (parts.size() < 2)
       {
-        const auto& policy = top_tokens[i];
-        auto parts = split(policy, ":");
+        throw std::runtime_error("invalid policy");
+      }
 
-        if (parts.size() < 2)
-        {
-          throw std::runtime_error("invalid policy");
-        }
+      auto policy_name = parts[0];
+      auto args = std::vector<std::string>(parts.begin() + 1, parts.end());
 
-        auto policy_name = parts[0];
-        auto args = std::vector<std::string>(parts.begin() + 1, parts.end());
+      if (policy_name == "subject")
+      {
+        StageScope stage(Stage::policy, PolicyType::subject);
 
-        if (policy_name == "subject")
+        if (args.size() % 2 != 0)
         {
-          if (args.size() % 2 != 0)
-          {
-            throw std::runtime_error("key-value pairs required");
-          }
-
-          if (args.size() < 2)
-          {
-            throw std::runtime_error("at least one key-value pair is required");
-          }
-
-          std::unordered_set<std::string> seen_fields;
-          for (size_t j = 0; j < args.size(); j += 2)
-          {
-            auto k = args[j];
-            if (k == "S")
-            {
-              // The correct key for state is ST, see
-              // https://www.rfc-editor.org/rfc/rfc4519#section-2.33
-              // and https://www.rfc-editor.org/rfc/rfc4514.html#section-3
-              // but the same text also says:
-              // > Implementations MAY recognize other DN string representations.
-              // and S is used instead by some issuers to mean State. DNs that
-              // contain both an S and a ST field are accordingly considered
-              // to contain a duplicate field, and rejected.
-              k = "ST";
-            }
-            const auto& v = url_unescape(args[j + 1]);
-
-            if (seen_fields.find(k) != seen_fields.end())
-            {
-              throw std::runtime_error(
-                std::string("duplicate field '") + k + "'");
-            }
-            seen_fields.insert(k);
-
-            const auto& lc = chain.at(0);
-            auto subject = lc.subject();
+          throw std::runtime_error("key-value pairs required");
+        }
 
-            auto sit = subject.find(k);
-            if (sit == subject.end())
-            {
-              throw std::runtime_error(
-                std::string("unsupported subject key: '") + k + "'");
-            }
+        if (args.size() < 2)
+        {
+          throw std::runtime_error("at least one key-value pair is required");
+        }
 
-            bool found = false;
-            for (const auto& fv : sit->second)
-            {
-              // The did:x509 spec defines subject matching via object.subset,
-              // i.e. exact equality of the attribute value. A substring match
-              // would incorrectly let e.g. "CN:Microsoft" match a certificate
-              // whose CN is "Microsoft Corporation".
-              if (fv == v)
-              {
-                found = true;
-                break;
-              }
-            }
-            if (!found)
-            {
-              throw std::runtime_error(
-                std::string("invalid subject key/value: " + k + "=" + v));
-            }
-          }
+        if (args.size() / 2 > limits.max_subject_pairs)
+        {
+          throw std::runtime_error("too many subject key-value pairs");
         }
-        else if (policy_name == "san")
+
+        std::unordered_set<std::string> seen_fields;
+        std::string buffer;
+        for (size_t j = 0; j < args.size(); j += 2)
         {
-          if (args.size() != 2)
+          auto k = args[j];
+          if (k == "S")
           {
-            throw std::runtime_error("exactly one SAN type and value required");
+            // The correct key for state is ST, see
+            // https://www.rfc-editor.org/rfc/rfc4519#section-2.33
+            // and https://www.rfc-editor.org/rfc/rfc4514.html#section-3
+            // but the same text also says:
+            // > Implementations MAY recognize other DN string representations.
+            // and S is used instead by some issuers to mean State. DNs that
+            // contain both an S and a ST field are accordingly considered
+            // to contain a duplicate field, and rejected.
+            k = "ST";
           }
+          const auto v = url_unescape(args[j + 1], buffer);
 
-          auto san_type = args[0];
-          auto san_value = url_unescape(args[1]);
-
-          if (!chain.at(0).has_san(san_type, san_value))
+          if (seen_fields.find(k) != seen_fields.end())
           {
             throw std::runtime_error(
-              std::string("SAN not found: ") + san_value);
-          }
-        }
-        else if (policy_name == "eku")
-        {
-          if (args.size() != 1)
-          {
-            throw std::runtime_error("exactly one EKU required");
+              std::string("duplicate field '") + k + "'");
           }
+          seen_fields.insert(k);
 
-          const UqASN1_OBJECT oid(args[0]);
+          auto subject = leaf.cert().subject();
 
-          bool found_eku = false;
-          auto eku_exts = chain.at(0).extended_key_usage();
-          for (size_t k = 0; k < eku_exts.size() && !found_eku; k++)
+          auto sit = subject.find(k);
+          if (sit == subject.end())
           {
-            const auto& eku_ext_k = eku_exts.at(k);
-            for (size_t j = 0; j < eku_ext_k.size() && !found_eku; j++)
-            {
-              if (eku_ext_k.at(j) == oid)
-              {
-                found_eku = true;
-              }
-            }
-          }
-          if (!found_eku)
-          {
-            throw std::runtime_error(std::string("EKU not found: ") + args[0]);
-          }
-        }
-        else if (policy_name == "fulcio-issuer")
-        {
-          if (args.size() != 1)
-          {
-            throw std::runtime_error("excessive arguments to fulcio-issuer");
+            stage.fail(ErrorCategory::subject_mismatch);
+            throw std::runtime_error(
+              std::string("unsupported subject key: '") + k + "'");
           }
 
-          const std::string fulcio_oid("1.3.6.1.4.1.57264.1.1");
-          auto decoded_arg = url_unescape(args[0]);
-          auto fulcio_issuer = "https://" + decoded_arg;
-
           bool found = false;
-          auto exts = chain.at(0).extensions<UqX509_EXTENSION>(fulcio_oid);
-          for (const auto& ext : exts)
+          for (const auto& fv : sit->second)
           {
-            if ((std::string)ext.data() == fulcio_issuer)
+            // The did:x509 spec defines subject matching via object.subset,
+            // i.e. exact equality of the attribute value. A substring match
+            // would incorrectly let e.g. "CN:Microsoft" match a certificate
+            // whose CN is "Microsoft Corporation".
+            if (fv == v)
             {
               found = true;
               break;
@@ -1576,88 +3104,363 @@ namespace didx509
           }
           if (!found)
           {
+            stage.fail(ErrorCategory::subject_mismatch);
             throw std::runtime_error(
-              std::string("invalid fulcio-issuer: ") + fulcio_issuer);
+              "invalid subject key/value: " + k + "=" + std::string(v));
           }
         }
-        else
+      }
+      else if (policy_name == "san")
+      {
+        StageScope stage(Stage::policy, PolicyType::san);
+
+        if (args.size() != 2)
         {
+          throw std::runtime_error("exactly one SAN type and value required");
+        }
+
+        const int san_type = san_gen_type(args[0]);
+        std::string buffer;
+        const auto san_value = url_unescape(args[1], buffer);
+
+        auto& sans = leaf.sans(limits.max_san_entries);
+        if (!sans.contains(san_type, san_value))
+        {
+          stage.fail(ErrorCategory::san_not_found);
           throw std::runtime_error(
-            std::string("unsupported did:x509 scheme '") + policy_name + "'");
+            "SAN not found: " + std::string(san_value));
         }
       }
-    }
+      else if (policy_name == "eku")
+      {
+        StageScope stage(Stage::policy, PolicyType::eku);
 
-    inline std::pair<bool, bool> is_agreed_signature_key(const UqX509& cert)
-    {
-      const bool include_assertion_method =
-        !cert.has_key_usage() || cert.has_key_usage_digital_signature();
-      const bool include_key_agreement =
-        !cert.has_key_usage() || cert.has_key_usage_key_agreement();
-      if (!include_assertion_method && !include_key_agreement)
+        if (args.size() != 1)
+        {
+          throw std::runtime_error("exactly one EKU required");
+        }
+
+        const auto oid = encode_oid(args[0]);
+        if (!oid)
+        {
+          throw std::runtime_error(
+            std::string("invalid EKU OID: ") + args[0]);
+        }
+
+        const EkuView ekus(leaf.extensions(), limits.max_eku_entries);
+        const bool found_eku = ekus.contains(*oid);
+        if (!found_eku)
+        {
+          stage.fail(ErrorCategory::eku_not_found);
+          throw std::runtime_error(std::string("EKU not found: ") + args[0]);
+        }
+      }
+      else if (policy_name == "fulcio-issuer")
+      {
+        StageScope stage(Stage::policy, PolicyType::fulcio_issuer);
+
+        if (args.size() != 1)
+        {
+          throw std::runtime_error("excessive arguments to fulcio-issuer");
+        }
+
+        std::string buffer;
+        const auto decoded_arg = url_unescape(args[0], buffer);
+
+        // The policy value is the (v1) issuer extension without its
+        // https:// scheme; the raw extension bytes are compared verbatim.
+        if (!leaf.has_fulcio_issuer(decoded_arg))
+        {
+          stage.fail(ErrorCategory::fulcio_issuer_mismatch);
+          throw std::runtime_error(
+            "invalid fulcio-issuer: https://" + std::string(decoded_arg));
+        }
+      }
+      else
       {
+        const StageScope stage(Stage::policy, PolicyType::unknown);
         throw std::runtime_error(
-          "certificate key usage must include digital signature or key "
-          "agreement");
+          std::string("unsupported did:x509 scheme '") + policy_name + "'");
       }
-
-      return {include_assertion_method, include_key_agreement};
     }
 
-    // Escape a string so it can be safely embedded inside a JSON string
-    // literal. The did is attacker-influenced input; without escaping, a did
-    // containing '"', '\\' or control characters could break out of the JSON
-    // string and corrupt or inject structure into the resulting document.
-    inline std::string json_escape_string(const std::string& s)
+    /// Relative cost of evaluating a policy. Malformed and unknown policies
+    /// fail without touching the certificate and so come first.
+    inline int policy_cost(const std::string& policy)
     {
-      static const char* const hex = "0123456789abcdef";
-      std::string r;
-      r.reserve(s.size() + 2);
-      for (const char ch : s)
+      const auto name = std::string_view(policy).substr(0, policy.find(':'));
+      if (name == "eku")
       {
-        const auto c = static_cast<unsigned char>(ch);
-        switch (c)
-        {
-          case '"':
-            r += "\\\"";
-            break;
-          case '\\':
-            r += "\\\\";
-            break;
-          case '\b':
-            r += "\\b";
-            break;
-          case '\f':
-            r += "\\f";
-            break;
-          case '\n':
-            r += "\\n";
-            break;
-          case '\r':
-            r += "\\r";
-            break;
-          case '\t':
-            r += "\\t";
-            break;
-          default:
-            if (c < 0x20)
-            {
-              r += "\\u00";
-              r += hex[(c >> 4) & 0xF];
-              r += hex[c & 0xF];
-            }
-            else
-            {
-              r += static_cast<char>(c);
-            }
+        return 1;
+      }
+      if (name == "san")
+      {
+        return 2;
+      }
+      if (name == "subject")
+      {
+        return 3;
+      }
+      if (name == "fulcio-issuer")
+      {
+        return 4;
+      }
+      return 0;
+    }
+
+    /// The cost-ordered part of Evaluation::cost_ordered, run on the presented
+    /// (not yet verified) chain: the leaf's policies, cheapest first, then the
+    /// CA fingerprint. The verified chain has the same leaf and its CAs are a
+    /// subset of the presented ones, so any failure here is also a failure of
+    /// strict evaluation.
+    inline void precheck(
+      const UqSTACK_OF_X509& chain,
+      const ParsedDid& did,
+      const Limits& limits)
+    {
+      std::vector<std::pair<int, const std::string*>> plan;
+      plan.reserve(did.policies.size());
+      for (const auto& policy : did.policies)
+      {
+        plan.emplace_back(policy_cost(policy), &policy);
+      }
+      std::stable_sort(
+        plan.begin(), plan.end(), [](const auto& a, const auto& b) {
+          return a.first < b.first;
+        });
+
+      LeafContext leaf(chain.at(0));
+      for (const auto& [cost, policy] : plan)
+      {
+        check_policy(leaf, *policy, limits);
+      }
+
+      check_fingerprint(chain, did.fingerprint_alg, did.fingerprint);
+    }
+
+    inline void verify(
+      ChainContext& context, const std::string& did, const Limits& limits = {})
+    {
+      check_did_limits(did, limits);
+
+      const auto parsed = parse_did(did);
+
+      context.check_fingerprint(parsed.fingerprint_alg, parsed.fingerprint);
+
+      for (const auto& policy : parsed.policies)
+      {
+        check_policy(context.leaf(), policy, limits);
+      }
+    }
+
+    inline void verify(
+      const UqSTACK_OF_X509& chain,
+      const std::string& did,
+      const Limits& limits = {})
+    {
+      ChainContext context(chain);
+      verify(context, did, limits);
+    }
+
+    inline std::pair<bool, bool> is_agreed_signature_key(X509View cert)
+    {
+      const bool include_assertion_method =
+        !cert.has_key_usage() || cert.has_key_usage_digital_signature();
+      const bool include_key_agreement =
+        !cert.has_key_usage() || cert.has_key_usage_key_agreement();
+      if (!include_assertion_method && !include_key_agreement)
+      {
+        throw std::runtime_error(
+          "certificate key usage must include digital signature or key "
+          "agreement");
+      }
+
+      return {include_assertion_method, include_key_agreement};
+    }
+
+    // Append the JSON escape for one character. Characters that do not need
+    // escaping are appended unchanged.
+    inline void json_escape_char(unsigned char c, std::string& r)
+    {
+      static const char* const hex = "0123456789abcdef";
+      switch (c)
+      {
+        case '"':
+          r += "\\\"";
+          break;
+        case '\\':
+          r += "\\\\";
+          break;
+        case '\b':
+          r += "\\b";
+          break;
+        case '\f':
+          r += "\\f";
+          break;
+        case '\n':
+          r += "\\n";
+          break;
+        case '\r':
+          r += "\\r";
+          break;
+        case '\t':
+          r += "\\t";
+          break;
+        default:
+          if (c < 0x20)
+          {
+            r += "\\u00";
+            r += hex[(c >> 4) & 0xF];
+            r += hex[c & 0xF];
+          }
+          else
+          {
+            r += static_cast<char>(c);
+          }
+      }
+    }
+
+    constexpr bool json_needs_escape(unsigned char c)
+    {
+      return c == '"' || c == '\\' || c < 0x20;
+    }
+
+    /// Returns the length of the longest prefix of [p, p + n) that can be
+    /// copied into a JSON string literal without escaping.
+    using JsonScanFunction = size_t (*)(const char* p, size_t n);
+
+    inline size_t json_clean_prefix_scalar(const char* p, size_t n)
+    {
+      size_t i = 0;
+      while (i < n && !json_needs_escape(static_cast<unsigned char>(p[i])))
+      {
+        i++;
+      }
+      return i;
+    }
+
+#if defined(DIDX509CPP_JSON_SSE2)
+    inline size_t json_clean_prefix_sse2(const char* p, size_t n)
+    {
+      const __m128i quote = _mm_set1_epi8('"');
+      const __m128i backslash = _mm_set1_epi8('\\');
+      const __m128i control = _mm_set1_epi8(0x1F);
+      size_t i = 0;
+      for (; i + 16 <= n; i += 16)
+      {
+        const __m128i v = _mm_loadu_si128((const __m128i*)(p + i));
+        // Unsigned v <= 0x1F is max(v, 0x1F) == 0x1F.
+        const __m128i hits = _mm_or_si128(
+          _mm_or_si128(_mm_cmpeq_epi8(v, quote), _mm_cmpeq_epi8(v, backslash)),
+          _mm_cmpeq_epi8(_mm_max_epu8(v, control), control));
+        const auto mask = static_cast<unsigned>(_mm_movemask_epi8(hits));
+        if (mask != 0)
+        {
+          return i + std::countr_zero(mask);
+        }
+      }
+      return i + json_clean_prefix_scalar(p + i, n - i);
+    }
+#endif
+
+#if defined(DIDX509CPP_JSON_AVX2)
+    __attribute__((target("avx2"))) inline size_t json_clean_prefix_avx2(
+      const char* p, size_t n)
+    {
+      const __m256i quote = _mm256_set1_epi8('"');
+      const __m256i backslash = _mm256_set1_epi8('\\');
+      const __m256i control = _mm256_set1_epi8(0x1F);
+      size_t i = 0;
+      for (; i + 32 <= n; i += 32)
+      {
+        const __m256i v = _mm256_loadu_si256((const __m256i*)(p + i));
+        const __m256i hits = _mm256_or_si256(
+          _mm256_or_si256(
+            _mm256_cmpeq_epi8(v, quote), _mm256_cmpeq_epi8(v, backslash)),
+          _mm256_cmpeq_epi8(_mm256_max_epu8(v, control), control));
+        const auto mask = static_cast<unsigned>(_mm256_movemask_epi8(hits));
+        if (mask != 0)
+        {
+          return i + std::countr_zero(mask);
+        }
+      }
+      return i + json_clean_prefix_sse2(p + i, n - i);
+    }
+#endif
+
+    /// The scanners usable on this CPU, best first. The scalar scanner is
+    /// always last.
+    inline std::vector<JsonScanFunction> json_scan_functions()
+    {
+      std::vector<JsonScanFunction> r;
+#if defined(DIDX509CPP_JSON_AVX2)
+      if (__builtin_cpu_supports("avx2"))
+      {
+        r.push_back(json_clean_prefix_avx2);
+      }
+#endif
+#if defined(DIDX509CPP_JSON_SSE2)
+      r.push_back(json_clean_prefix_sse2);
+#endif
+      r.push_back(json_clean_prefix_scalar);
+      return r;
+    }
+
+    inline JsonScanFunction json_scan_function()
+    {
+      static const JsonScanFunction best = json_scan_functions().front();
+      return best;
+    }
+
+    // Escape a string so it can be safely embedded inside a JSON string
+    // literal. The did is attacker-influenced input; without escaping, a did
+    // containing '"', '\\' or control characters could break out of the JSON
+    // string and corrupt or inject structure into the resulting document.
+    //
+    // Runs that need no escaping are found with `scan` and copied in bulk;
+    // only the characters in between go through json_escape_char.
+    inline std::string json_escape_string(
+      std::string_view s, JsonScanFunction scan)
+    {
+      std::string r;
+      r.reserve(s.size() + 2);
+      size_t i = 0;
+      while (i < s.size())
+      {
+        const size_t clean = scan(s.data() + i, s.size() - i);
+        r.append(s.data() + i, clean);
+        i += clean;
+        if (i < s.size())
+        {
+          json_escape_char(static_cast<unsigned char>(s[i]), r);
+          i++;
         }
       }
       return r;
     }
 
+    inline std::string json_escape_string(const std::string& s)
+    {
+      return json_escape_string(s, json_scan_function());
+    }
+
+    /// Character-at-a-time reference escaper.
+    inline std::string json_escape_string_scalar(std::string_view s)
+    {
+      std::string r;
+      r.reserve(s.size() + 2);
+      for (const char ch : s)
+      {
+        json_escape_char(static_cast<unsigned char>(ch), r);
+      }
+      return r;
+    }
+
     inline std::string create_did_document(
       const std::string& did, const UqSTACK_OF_X509& chain)
     {
+      const StageScope stage(Stage::create_did_document);
+
       const auto& leaf = chain.front();
       const auto& [include_assertion_method, include_key_agreement] =
         is_agreed_signature_key(leaf);
@@ -1697,52 +3500,3565 @@ namespace didx509
       r += "\n}";
       return r;
     }
-  }
 
-  inline UqSTACK_OF_X509 resolve_chain(
-    const UqSTACK_OF_X509& chain,
-    const std::string& did,
-    bool ignore_time = false)
-  {
-    if (chain.empty())
+    /// Where a certificate's subject and subject key identifier are in its
+    /// DER encoding, found by walking the TBSCertificate without parsing it.
+    struct DerCertificateIndex
     {
-      throw std::runtime_error("no certificate chain");
-    }
+      std::string_view subject;
+      std::string_view skid;
+    };
 
-    // The last certificate in the chain is assumed to be the trusted root.
-    UqX509 root = chain.back();
+    /// Indexes the certificate at the start of der, whose length must match
+    /// its outer header. Returns std::nullopt if the structure is invalid.
+    inline std::optional<DerCertificateIndex> index_der_certificate(
+      std::span<const uint8_t> der)
+    {
+      const uint8_t* p = der.data();
+      const uint8_t* const end = p + der.size();
+      uint8_t tag = 0;
+      size_t len = 0;
 
-    std::vector<UqX509> roots;
-    roots.emplace_back(std::move(root));
+      if (!der_header(p, end, tag, len) || tag != 0x30 || p + len != end)
+      {
+        return std::nullopt;
+      }
+      if (!der_header(p, end, tag, len) || tag != 0x30)
+      {
+        return std::nullopt;
+      }
+      const uint8_t* const tbs_end = p + len;
 
-    auto valid_chain = chain.verify(roots, ignore_time);
-    verify(valid_chain, did);
+      // Skips one element with the given tag, returning where it started.
+      const auto skip = [&](uint8_t expected) -> const uint8_t* {
+        const uint8_t* start = p;
+        if (!der_header(p, tbs_end, tag, len) || tag != expected)
+        {
+          return nullptr;
+        }
+        p += len;
+        return start;
+      };
+      const auto as_view = [](const uint8_t* begin, const uint8_t* end) {
+        return std::string_view((const char*)begin, end - begin);
+      };
 
-    return valid_chain;
+      if (p < tbs_end && *p == 0xA0 && skip(0xA0) == nullptr)
+      {
+        return std::nullopt;
+      }
+      // serialNumber, signature, issuer and validity.
+      for (const uint8_t expected : {0x02, 0x30, 0x30, 0x30})
+      {
+        if (skip(expected) == nullptr)
+        {
+          return std::nullopt;
+        }
+      }
+      const uint8_t* subject = skip(0x30);
+      if (subject == nullptr)
+      {
+        return std::nullopt;
+      }
+      DerCertificateIndex r;
+      r.subject = as_view(subject, p);
+
+      // subjectPublicKeyInfo and the optional unique identifiers.
+      if (
+        skip(0x30) == nullptr ||
+        (p < tbs_end && *p == 0x81 && skip(0x81) == nullptr) ||
+        (p < tbs_end && *p == 0x82 && skip(0x82) == nullptr))
+      {
+        return std::nullopt;
+      }
+      if (p == tbs_end)
+      {
+        return r;
+      }
+      if (
+        !der_header(p, tbs_end, tag, len) || tag != 0xA3 ||
+        !der_header(p, tbs_end, tag, len) || tag != 0x30)
+      {
+        return std::nullopt;
+      }
+      const uint8_t* const extensions_end = p + len;
+      while (p < extensions_end)
+      {
+        if (!der_header(p, extensions_end, tag, len) || tag != 0x30)
+        {
+          return std::nullopt;
+        }
+        const uint8_t* const extension_end = p + len;
+        if (!der_header(p, extension_end, tag, len) || tag != 0x06)
+        {
+          return std::nullopt;
+        }
+        const auto oid = std::span<const uint8_t>(p, len);
+        p += len;
+        if (p < extension_end && *p == 0x01)
+        {
+          if (!der_header(p, extension_end, tag, len))
+          {
+            return std::nullopt;
+          }
+          p += len;
+        }
+        if (!der_header(p, extension_end, tag, len) || tag != 0x04)
+        {
+          return std::nullopt;
+        }
+        // The SubjectKeyIdentifier is itself an OCTET STRING.
+        const auto skid = oids::subject_key_identifier.bytes();
+        if (std::equal(oid.begin(), oid.end(), skid.begin(), skid.end()))
+        {
+          const uint8_t* value = p;
+          if (
+            !der_header(value, p + len, tag, len) || tag != 0x04 ||
+            value + len != extension_end)
+          {
+            return std::nullopt;
+          }
+          r.skid = as_view(value, value + len);
+        }
+        p = extension_end;
+      }
+      return r;
+    }
   }
 
-  inline std::string resolve(
-    const std::string& chain_pem,
-    const std::string& did,
-    bool ignore_time = false)
+  /// The contents of a file, memory-mapped where the platform supports it
+  /// and read into memory otherwise.
+  class MappedFile
   {
-    const UqSTACK_OF_X509 chain(chain_pem);
+  public:
+    explicit MappedFile(const std::string& path)
+    {
+#ifdef DIDX509CPP_MMAP
+      const int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+      if (fd < 0)
+      {
+        throw std::runtime_error("could not open " + path);
+      }
+      struct stat st = {};
+      if (::fstat(fd, &st) != 0)
+      {
+        ::close(fd);
+        throw std::runtime_error("could not stat " + path);
+      }
+      size = static_cast<size_t>(st.st_size);
+      if (size != 0)
+      {
+        void* m = ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (m == MAP_FAILED)
+        {
+          ::close(fd);
+          throw std::runtime_error("could not map " + path);
+        }
+        data = static_cast<const char*>(m);
+      }
+      ::close(fd);
+#else
+      std::ifstream f(path, std::ios::binary);
+      if (!f)
+      {
+        throw std::runtime_error("could not open " + path);
+      }
+      contents.assign(
+        std::istreambuf_iterator<char>(f), std::istreambuf_iterator<char>());
+      data = contents.data();
+      size = contents.size();
+#endif
+    }
 
-    const auto valid_chain = resolve_chain(chain, did, ignore_time);
-    return create_did_document(did, valid_chain);
-  }
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
 
-  inline std::string resolve_jwk(
-    const std::vector<std::string>& chain_pem,
-    const std::string& did,
-    bool ignore_time = false)
+    ~MappedFile()
+    {
+#ifdef DIDX509CPP_MMAP
+      if (size != 0)
+      {
+        ::munmap((char*)data, size);
+      }
+#endif
+    }
+
+    [[nodiscard]] std::string_view view() const
+    {
+      return {data, size};
+    }
+
+  private:
+    const char* data = nullptr;
+    size_t size = 0;
+#ifndef DIDX509CPP_MMAP
+    std::string contents;
+#endif
+  };
+
+  /// A bundle of trust anchors read from a DER or PEM file. The file is
+  /// memory-mapped and its certificates are indexed by subject, subject key
+  /// identifier and SHA-256 fingerprint without parsing them; each anchor is
+  /// parsed the first time a chain needs it. Loading therefore takes time
+  /// and memory proportional to the size of the file rather than to the
+  /// cost of parsing thousands of certificates.
+  ///
+  /// A DER bundle is a concatenation of DER certificates. In a PEM bundle,
+  /// text between the CERTIFICATE blocks (such as the comments in common CA
+  /// bundles) is ignored; PEM bundles in other forms are read with
+  /// OpenSSL's PEM reader instead. PEM bodies are decoded into memory, DER
+  /// bundles are used in place.
+  ///
+  /// Anchors are found by the exact DER encoding of their subject, which is
+  /// how chains name their issuers. Lookups are thread-safe.
+  class TrustBundle
   {
-    const UqSTACK_OF_X509 chain(chain_pem);
+  public:
+    explicit TrustBundle(const std::string& path) : file(path)
+    {
+      // A SEQUENCE tag is also the ASCII digit '0', so a file is only read
+      // as DER if it splits into whole DER elements. Anything else that
+      // starts with 0x30 is still PEM if it has an encapsulation boundary.
+      const auto data = file.view();
+      const bool der = !data.empty() && data[0] == 0x30;
+      if (!der || !split_der(as_bytes(data)))
+      {
+        if (der && data.find("-----BEGIN") == std::string_view::npos)
+        {
+          throw std::runtime_error("invalid DER trust bundle");
+        }
+        read_pem(data);
+      }
 
-    const auto valid_chain = resolve_chain(chain, did, ignore_time);
-    const auto& leaf = valid_chain.front();
-    is_agreed_signature_key(leaf);
+      parsed = std::make_unique<std::atomic<X509*>[]>(anchors.size());
+      for (size_t i = 0; i < anchors.size(); i++)
+      {
+        const auto index = index_der_certificate(anchors[i]);
+        if (!index)
+        {
+          throw std::runtime_error("invalid certificate in trust bundle");
+        }
+        by_subject.emplace(index->subject, i);
+        if (!index->skid.empty())
+        {
+          by_skid.emplace(index->skid, i);
+        }
+      }
+    }
 
-    return leaf.public_jwk();
-  }
+    TrustBundle(const TrustBundle&) = delete;
+    TrustBundle& operator=(const TrustBundle&) = delete;
+
+    ~TrustBundle()
+    {
+      for (size_t i = 0; i < anchors.size(); i++)
+      {
+        X509_free(parsed[i].load());
+      }
+    }
+
+    /// Number of anchors in the bundle.
+    [[nodiscard]] size_t size() const
+    {
+      return anchors.size();
+    }
+
+    /// Number of anchors parsed so far.
+    [[nodiscard]] size_t parsed_count() const
+    {
+      return parsed_anchors.load();
+    }
+
+    /// Anchor i, parsed on first use. The view is valid for the lifetime of
+    /// the bundle.
+    [[nodiscard]] X509View at(size_t i) const
+    {
+      if (i >= anchors.size())
+      {
+        throw std::out_of_range("trust anchor index out of range");
+      }
+      X509* x509 = parsed[i].load(std::memory_order_acquire);
+      if (x509 != nullptr)
+      {
+        return x509;
+      }
+
+      const std::lock_guard<std::mutex> lock(parse_mutex);
+      x509 = parsed[i].load(std::memory_order_relaxed);
+      if (x509 == nullptr)
+      {
+        const unsigned char* der = anchors[i].data();
+        x509 = d2i_X509(nullptr, &der, static_cast<long>(anchors[i].size()));
+        if (x509 == nullptr)
+        {
+          throw std::runtime_error("invalid certificate in trust bundle");
+        }
+        parsed[i].store(x509, std::memory_order_release);
+        parsed_anchors++;
+      }
+      return x509;
+    }
+
+    /// The DER encoding of anchor i, without parsing it.
+    [[nodiscard]] std::span<const uint8_t> der(size_t i) const
+    {
+      return anchors.at(i);
+    }
+
+    /// Anchors whose subject is exactly `subject`.
+    [[nodiscard]] std::vector<X509View> find_by_subject(
+      const X509_NAME* subject) const
+    {
+      const unsigned char* der = nullptr;
+      size_t len = 0;
+      CHECK1(X509_NAME_get0_der((X509_NAME*)subject, &der, &len));
+      return find(by_subject, std::string_view((const char*)der, len));
+    }
+
+    /// Anchors with the given subject key identifier.
+    [[nodiscard]] std::vector<X509View> find_by_skid(
+      std::span<const uint8_t> skid) const
+    {
+      return find(by_skid, as_chars(skid));
+    }
+
+    /// The anchor with the given SHA-256 fingerprint. The fingerprint index
+    /// is built on the first call.
+    [[nodiscard]] std::optional<X509View> find_by_fingerprint(
+      std::span<const uint8_t> sha256_fingerprint) const
+    {
+      const auto i = fingerprint_index(sha256_fingerprint);
+      if (!i)
+      {
+        return std::nullopt;
+      }
+      return at(*i);
+    }
+
+    /// Whether the bundle holds the anchor with the given SHA-256
+    /// fingerprint, without parsing it.
+    [[nodiscard]] bool contains(
+      std::span<const uint8_t> sha256_fingerprint) const
+    {
+      return fingerprint_index(sha256_fingerprint).has_value();
+    }
+
+    /// A store of the anchors that could complete or be part of the given
+    /// chain: those whose subject is the issuer or the subject of one of its
+    /// certificates. Only these anchors are parsed.
+    [[nodiscard]] UqX509_STORE make_store(const UqSTACK_OF_X509& chain) const
+    {
+      UqX509_STORE store;
+      std::unordered_set<size_t> added;
+      for (size_t i = 0; i < chain.size(); i++)
+      {
+        const X509* cert = chain.at(i);
+        for (const X509_NAME* name :
+             {X509_get_issuer_name(cert), X509_get_subject_name(cert)})
+        {
+          const unsigned char* der = nullptr;
+          size_t len = 0;
+          CHECK1(X509_NAME_get0_der((X509_NAME*)name, &der, &len));
+          const auto [first, last] =
+            by_subject.equal_range(std::string_view((const char*)der, len));
+          for (auto it = first; it != last; ++it)
+          {
+            if (added.insert(it->second).second)
+            {
+              CHECK1(X509_STORE_add_cert(store, at(it->second)));
+            }
+          }
+        }
+      }
+      return store;
+    }
+
+    /// Verifies a chain against the anchors in the bundle.
+    [[nodiscard]] UqSTACK_OF_X509 verify(
+      const UqSTACK_OF_X509& chain,
+      bool ignore_time = false,
+      const Limits& limits = {}) const
+    {
+      return chain.verify(make_store(chain), ignore_time, true, limits);
+    }
+
+    [[nodiscard]] UqSTACK_OF_X509 verify(
+      const UqSTACK_OF_X509& chain,
+      std::chrono::system_clock::time_point at,
+      const Limits& limits = {}) const
+    {
+      return chain.verify(make_store(chain), at, true, limits);
+    }
+
+  private:
+    using Index = std::unordered_multimap<std::string_view, size_t>;
+
+    static std::span<const uint8_t> as_bytes(std::string_view s)
+    {
+      return {(const uint8_t*)s.data(), s.size()};
+    }
+
+    static std::string_view as_chars(std::span<const uint8_t> s)
+    {
+      return {(const char*)s.data(), s.size()};
+    }
+
+    std::optional<size_t> fingerprint_index(
+      std::span<const uint8_t> sha256_fingerprint) const
+    {
+      std::call_once(fingerprints_built, [this]() {
+        fingerprints.reserve(anchors.size());
+        for (size_t i = 0; i < anchors.size(); i++)
+        {
+          std::string digest(EVP_MAX_MD_SIZE, '\0');
+          unsigned int size = 0;
+          CHECK1(EVP_Digest(
+            anchors[i].data(),
+            anchors[i].size(),
+            (unsigned char*)digest.data(),
+            &size,
+            Digests::get().sha256,
+            nullptr));
+          digest.resize(size);
+          fingerprints.emplace(std::move(digest), i);
+        }
+      });
+      const auto it =
+        fingerprints.find(std::string(as_chars(sha256_fingerprint)));
+      if (it == fingerprints.end())
+      {
+        return std::nullopt;
+      }
+      return it->second;
+    }
+
+    std::vector<X509View> find(const Index& index, std::string_view key) const
+    {
+      std::vector<X509View> r;
+      const auto [first, last] = index.equal_range(key);
+      for (auto it = first; it != last; ++it)
+      {
+        r.push_back(at(it->second));
+      }
+      return r;
+    }
+
+    // Splits data into concatenated DER SEQUENCEs, leaving no anchors and
+    // returning false if it is not exactly that.
+    bool split_der(std::span<const uint8_t> data)
+    {
+      const uint8_t* p = data.data();
+      const uint8_t* const end = p + data.size();
+      while (p != end)
+      {
+        const uint8_t* start = p;
+        uint8_t tag = 0;
+        size_t len = 0;
+        if (!der_header(p, end, tag, len) || tag != 0x30)
+        {
+          anchors.clear();
+          return false;
+        }
+        p += len;
+        anchors.emplace_back(start, p);
+      }
+      return true;
+    }
+
+    void read_pem(std::string_view data)
+    {
+      std::vector<std::pair<size_t, size_t>> blocks;
+      if (!decode_pem_certificates(data, arena, blocks, true))
+      {
+        blocks.clear();
+        read_pem_generic(data, blocks);
+      }
+      for (const auto& [offset, length] : blocks)
+      {
+        anchors.emplace_back(arena.data() + offset, length);
+      }
+    }
+
+    // Re-encodes whatever OpenSSL's PEM reader accepts into the arena.
+    void read_pem_generic(
+      std::string_view data, std::vector<std::pair<size_t, size_t>>& blocks)
+    {
+      arena.clear();
+      UqBIO bio(data.data(), static_cast<int>(data.size()));
+      while (true)
+      {
+        ERR_set_mark();
+        X509* x509 = PEM_read_bio_X509(bio, nullptr, nullptr, nullptr);
+        if (x509 == nullptr)
+        {
+          const auto err = ERR_peek_last_error();
+          ERR_pop_to_mark();
+          if (
+            blocks.empty() || ERR_GET_LIB(err) != ERR_LIB_PEM ||
+            ERR_GET_REASON(err) != PEM_R_NO_START_LINE)
+          {
+            throw std::runtime_error("invalid PEM trust bundle");
+          }
+          break;
+        }
+        ERR_pop_to_mark();
+        const std::unique_ptr<X509, SSLDeleter<X509_free>> cert(x509);
+        const int len = i2d_X509(cert.get(), nullptr);
+        if (len <= 0)
+        {
+          throw std::runtime_error("invalid PEM trust bundle");
+        }
+        const size_t offset = arena.size();
+        arena.resize(offset + len);
+        unsigned char* out = arena.data() + offset;
+        i2d_X509(cert.get(), &out);
+        blocks.emplace_back(offset, len);
+      }
+    }
+
+    MappedFile file;
+    std::vector<uint8_t> arena;
+    std::vector<std::span<const uint8_t>> anchors;
+    Index by_subject;
+    Index by_skid;
+
+    std::unique_ptr<std::atomic<X509*>[]> parsed;
+    mutable std::atomic<size_t> parsed_anchors = 0;
+    mutable std::mutex parse_mutex;
+
+    mutable std::once_flag fingerprints_built;
+    mutable std::unordered_map<std::string, size_t> fingerprints;
+  };
+
+  inline UqSTACK_OF_X509 resolve_chain(
+    const UqSTACK_OF_X509& chain,
+    const std::string& did,
+    bool ignore_time = false,
+    const Limits& limits = {},
+    Evaluation evaluation = Evaluation::strict)
+  {
+    if (chain.empty())
+    {
+      throw std::runtime_error("no certificate chain");
+    }
+    check_did_limits(did, limits);
+
+    std::optional<ParsedDid> parsed;
+    if (evaluation == Evaluation::cost_ordered)
+    {
+      parsed = parse_did(did);
+      precheck(chain, *parsed, limits);
+    }
+
+    // The last certificate in the chain is assumed to be the trusted root.
+    UqX509 root = chain.back();
+
+    std::vector<UqX509> roots;
+    roots.emplace_back(std::move(root));
+
+    auto valid_chain = chain.verify(roots, ignore_time, true, limits);
+    if (parsed)
+    {
+      check_fingerprint(
+        valid_chain, parsed->fingerprint_alg, parsed->fingerprint);
+    }
+    else
+    {
+      verify(valid_chain, did, limits);
+    }
+
+    return valid_chain;
+  }
+
+  /// Resolves as of time `at` rather than now, for audits of historical
+  /// signatures: certificate validity periods are checked against `at`.
+  inline UqSTACK_OF_X509 resolve_chain(
+    const UqSTACK_OF_X509& chain,
+    const std::string& did,
+    std::chrono::system_clock::time_point at,
+    const Limits& limits = {},
+    Evaluation evaluation = Evaluation::strict)
+  {
+    if (chain.empty())
+    {
+      throw std::runtime_error("no certificate chain");
+    }
+    check_did_limits(did, limits);
+
+    std::optional<ParsedDid> parsed;
+    if (evaluation == Evaluation::cost_ordered)
+    {
+      parsed = parse_did(did);
+      precheck(chain, *parsed, limits);
+    }
+
+    std::vector<UqX509> roots;
+    roots.emplace_back(chain.back());
+
+    auto valid_chain = chain.verify(roots, at, true, limits);
+    if (parsed)
+    {
+      check_fingerprint(
+        valid_chain, parsed->fingerprint_alg, parsed->fingerprint);
+    }
+    else
+    {
+      verify(valid_chain, did, limits);
+    }
+
+    return valid_chain;
+  }
+
+  /// Outcome of checking one DID in resolve_chain_many().
+  struct DidMatch
+  {
+    bool matched = false;
+    /// Why the DID did not match; empty if it did.
+    std::string error;
+  };
+
+  namespace
+  {
+    /// A verified chain and, for each DID checked against it, whether it
+    /// matched.
+    struct ChainMatches
+    {
+      UqSTACK_OF_X509 chain;
+      std::vector<DidMatch> matches;
+    };
+
+    inline std::vector<DidMatch> match_dids(
+      const UqSTACK_OF_X509& valid_chain,
+      std::span<const std::string> dids,
+      const Limits& limits)
+    {
+      ChainContext context(valid_chain);
+      std::vector<DidMatch> matches(dids.size());
+      for (size_t i = 0; i < dids.size(); i++)
+      {
+        try
+        {
+          verify(context, dids[i], limits);
+          matches[i].matched = true;
+        }
+        catch (const std::exception& e)
+        {
+          matches[i].error = e.what();
+        }
+      }
+      return matches;
+    }
+  }
+
+  /// Checks a chain against several DIDs at once, e.g. one per tenant. The
+  /// chain is verified once (throwing if it is invalid, as no DID can match
+  /// then), each CA certificate is hashed at most once per fingerprint
+  /// algorithm, and the leaf's extensions are decoded once for all DIDs.
+  inline ChainMatches resolve_chain_many(
+    const UqSTACK_OF_X509& chain,
+    std::span<const std::string> dids,
+    bool ignore_time = false,
+    const Limits& limits = {})
+  {
+    if (chain.empty())
+    {
+      throw std::runtime_error("no certificate chain");
+    }
+
+    std::vector<UqX509> roots;
+    roots.emplace_back(chain.back());
+
+    auto valid_chain = chain.verify(roots, ignore_time, true, limits);
+    auto matches = match_dids(valid_chain, dids, limits);
+    return {std::move(valid_chain), std::move(matches)};
+  }
+
+  inline ChainMatches resolve_chain_many(
+    const UqSTACK_OF_X509& chain,
+    std::span<const std::string> dids,
+    std::chrono::system_clock::time_point at,
+    const Limits& limits = {})
+  {
+    if (chain.empty())
+    {
+      throw std::runtime_error("no certificate chain");
+    }
+
+    std::vector<UqX509> roots;
+    roots.emplace_back(chain.back());
+
+    auto valid_chain = chain.verify(roots, at, true, limits);
+    auto matches = match_dids(valid_chain, dids, limits);
+    return {std::move(valid_chain), std::move(matches)};
+  }
+
+  namespace
+  {
+    // Anchor keys summarize one policy as a single attribute that any leaf
+    // satisfying the policy must have: an EKU OID, a SAN entry, a subject
+    // attribute or the Fulcio issuer. The leading byte tags the kind.
+
+    inline std::string subject_anchor(
+      const std::string& key, const std::string& value)
+    {
+      return "n" + std::to_string(key.size()) + ":" + key + value;
+    }
+
+    /// The anchor key of a policy, or std::nullopt if the policy cannot be
+    /// summarized (it is then malformed or unknown, and is checked in full).
+    inline std::optional<std::string> policy_anchor(const std::string& policy)
+    {
+      const auto parts = split(policy, ":");
+      if (parts.size() < 2)
+      {
+        return std::nullopt;
+      }
+
+      const auto& name = parts[0];
+      if (name == "eku" && parts.size() == 2)
+      {
+        const auto oid = encode_oid(parts[1]);
+        if (!oid)
+        {
+          return std::nullopt;
+        }
+        const auto bytes = oid->bytes();
+        return "e" + std::string(bytes.begin(), bytes.end());
+      }
+      if (name == "san" && parts.size() == 3)
+      {
+        if (parts[1] != "dns" && parts[1] != "email" && parts[1] != "uri")
+        {
+          return std::nullopt;
+        }
+        const auto type = static_cast<char>(san_gen_type(parts[1]));
+        return "s" + std::string(1, type) + url_unescape(parts[2]);
+      }
+      if (name == "subject" && parts.size() >= 3 && parts.size() % 2 == 1)
+      {
+        const std::string key = parts[1] == "S" ? "ST" : parts[1];
+        return subject_anchor(key, url_unescape(parts[2]));
+      }
+      if (name == "fulcio-issuer" && parts.size() == 2)
+      {
+        return "f" + std::string("https://") + url_unescape(parts[1]);
+      }
+      return std::nullopt;
+    }
+
+    /// Anchor keys of every attribute of the leaf that a policy can match.
+    /// Attributes that cannot be decoded within the limits are skipped: every
+    /// policy on them fails verification anyway.
+    inline std::vector<std::string> leaf_anchors(
+      LeafContext& leaf, const Limits& limits)
+    {
+      std::vector<std::string> r;
+      try
+      {
+        for (const auto& oid :
+             EkuView(leaf.extensions(), limits.max_eku_entries))
+        {
+          r.push_back("e" + std::string(oid.begin(), oid.end()));
+        }
+      }
+      catch (const std::exception&)
+      {}
+      try
+      {
+        for (const auto& e : leaf.sans(limits.max_san_entries))
+        {
+          if (e.value.data() != nullptr)
+          {
+            r.push_back(
+              "s" + std::string(1, static_cast<char>(e.type)) +
+              std::string(e.value));
+          }
+        }
+      }
+      catch (const std::exception&)
+      {}
+      try
+      {
+        for (const auto& [key, values] : leaf.cert().subject())
+        {
+          for (const auto& value : values)
+          {
+            r.push_back(subject_anchor(key, value));
+          }
+        }
+      }
+      catch (const std::exception&)
+      {}
+      for (const auto issuer : leaf.fulcio_issuers())
+      {
+        r.push_back("f" + std::string(issuer));
+      }
+      return r;
+    }
+  }
+
+  /// Matches verified chains against a large, fixed set of DIDs. DIDs are
+  /// indexed by CA fingerprint and then by their most selective policy, so a
+  /// lookup only verifies the few DIDs whose fingerprint matches a CA of the
+  /// chain and whose anchor policy matches an attribute of the leaf. Matches
+  /// are confirmed with the same verification as resolve_chain(), so the
+  /// result is exactly the set of DIDs that verify() accepts.
+  class DidPolicyIndex
+  {
+  public:
+    explicit DidPolicyIndex(
+      std::vector<std::string> dids, const Limits& limits = {}) :
+      dids(std::move(dids)),
+      limits(limits)
+    {
+      // DIDs that fail independently of any chain can never match and are
+      // left out of the index.
+      struct Entry
+      {
+        size_t slot;
+        std::string fingerprint;
+        std::vector<std::string> anchors;
+      };
+      std::vector<std::optional<Entry>> entries(this->dids.size());
+      std::unordered_map<std::string, size_t> frequency;
+      for (size_t i = 0; i < this->dids.size(); i++)
+      {
+        const auto& did = this->dids[i];
+        ParsedDid parsed;
+        try
+        {
+          check_did_limits(did, limits);
+          parsed = parse_did(did);
+        }
+        catch (const std::exception&)
+        {
+          continue;
+        }
+        const auto slot = algorithm_slot(parsed.fingerprint_alg);
+        if (!slot)
+        {
+          continue;
+        }
+
+        Entry entry{*slot, std::move(parsed.fingerprint), {}};
+        for (const auto& policy : parsed.policies)
+        {
+          if (auto anchor = policy_anchor(policy))
+          {
+            frequency[*anchor]++;
+            entry.anchors.push_back(std::move(*anchor));
+          }
+        }
+        entries[i] = std::move(entry);
+      }
+
+      // Anchor each DID on its rarest policy, which keeps buckets small even
+      // when many DIDs share e.g. an EKU.
+      for (size_t i = 0; i < entries.size(); i++)
+      {
+        if (!entries[i])
+        {
+          continue;
+        }
+        auto& entry = *entries[i];
+        auto& bucket = buckets[entry.slot][entry.fingerprint];
+        const auto rarest = std::min_element(
+          entry.anchors.begin(),
+          entry.anchors.end(),
+          [&frequency](const auto& a, const auto& b) {
+            return frequency[a] < frequency[b];
+          });
+        if (rarest == entry.anchors.end())
+        {
+          bucket.unanchored.push_back(i);
+        }
+        else
+        {
+          bucket.anchored[*rarest].push_back(i);
+        }
+      }
+    }
+
+    [[nodiscard]] size_t size() const
+    {
+      return dids.size();
+    }
+
+    [[nodiscard]] const std::string& did(size_t i) const
+    {
+      return dids.at(i);
+    }
+
+    /// Indices, in ascending order, of all DIDs that match the verified
+    /// chain.
+    [[nodiscard]] std::vector<size_t> match(
+      const UqSTACK_OF_X509& valid_chain) const
+    {
+      ChainContext context(valid_chain);
+      std::optional<std::vector<std::string>> anchors;
+      std::vector<size_t> candidates;
+
+      for (size_t slot = 0; slot < buckets.size(); slot++)
+      {
+        if (buckets[slot].empty())
+        {
+          continue;
+        }
+        for (size_t i = 1; i < valid_chain.size(); i++)
+        {
+          const auto* fingerprint =
+            context.fingerprint_cache().fingerprint_of(algorithms[slot], i);
+          const auto bucket = buckets[slot].find(*fingerprint);
+          if (bucket == buckets[slot].end())
+          {
+            continue;
+          }
+
+          const auto& unanchored = bucket->second.unanchored;
+          candidates.insert(
+            candidates.end(), unanchored.begin(), unanchored.end());
+          if (bucket->second.anchored.empty())
+          {
+            continue;
+          }
+          if (!anchors)
+          {
+            anchors = leaf_anchors(context.leaf(), limits);
+          }
+          for (const auto& anchor : *anchors)
+          {
+            const auto it = bucket->second.anchored.find(anchor);
+            if (it != bucket->second.anchored.end())
+            {
+              candidates.insert(
+                candidates.end(), it->second.begin(), it->second.end());
+            }
+          }
+        }
+      }
+
+      std::sort(candidates.begin(), candidates.end());
+      candidates.erase(
+        std::unique(candidates.begin(), candidates.end()), candidates.end());
+
+      std::vector<size_t> r;
+      for (const auto i : candidates)
+      {
+        try
+        {
+          verify(context, dids[i], limits);
+          r.push_back(i);
+        }
+        catch (const std::exception&)
+        {}
+      }
+      return r;
+    }
+
+  private:
+    static constexpr std::array<const char*, 3> algorithms = {
+      "sha256", "sha384", "sha512"};
+
+    struct Bucket
+    {
+      std::unordered_map<std::string, std::vector<size_t>> anchored;
+      std::vector<size_t> unanchored;
+    };
+
+    std::vector<std::string> dids;
+    Limits limits;
+    std::array<std::unordered_map<std::string, Bucket>, 3> buckets;
+
+    static std::optional<size_t> algorithm_slot(const std::string& alg)
+    {
+      for (size_t i = 0; i < algorithms.size(); i++)
+      {
+        if (alg == algorithms[i])
+        {
+          return i;
+        }
+      }
+      return std::nullopt;
+    }
+  };
+
+  /// A policy to embed in a generated DID. Arguments are given unescaped and
+  /// are percent-encoded by the generator where the did:x509 syntax requires
+  /// it.
+  struct DidPolicy
+  {
+    std::string name;
+    std::vector<std::string> args;
+
+    /// Subject policy requiring each attribute (e.g. {"CN", "Contoso"}).
+    static DidPolicy subject(
+      const std::vector<std::pair<std::string, std::string>>& attributes)
+    {
+      DidPolicy r{"subject", {}};
+      for (const auto& [key, value] : attributes)
+      {
+        r.args.push_back(key);
+        r.args.push_back(value);
+      }
+      return r;
+    }
+
+    /// SAN policy; type is one of "dns", "email" or "uri".
+    static DidPolicy san(std::string type, std::string value)
+    {
+      return {"san", {std::move(type), std::move(value)}};
+    }
+
+    /// EKU policy for a dotted-decimal OID.
+    static DidPolicy eku(std::string oid)
+    {
+      return {"eku", {std::move(oid)}};
+    }
+
+    /// Fulcio issuer policy for an https:// issuer URL.
+    static DidPolicy fulcio_issuer(const std::string& issuer)
+    {
+      constexpr std::string_view scheme = "https://";
+      if (!issuer.starts_with(scheme))
+      {
+        throw std::invalid_argument("Fulcio issuer must be an https:// URL");
+      }
+      return {"fulcio-issuer", {issuer.substr(scheme.size())}};
+    }
+  };
+
+  /// Generates DIDs anchored on one CA certificate. The CA is hashed once, in
+  /// the constructor, so minting DIDs for many leaves under the same CA only
+  /// costs the string encoding of their policies.
+  class DidGenerator
+  {
+  public:
+    DidGenerator(X509View ca, const std::string& fingerprint_alg)
+    {
+      const auto hash = fingerprint_algorithm(fingerprint_alg).second;
+      if (hash == nullptr)
+      {
+        throw std::invalid_argument("unsupported fingerprint algorithm");
+      }
+      prefix =
+        "did:x509:0:" + fingerprint_alg + ":" + to_base64url(hash(ca.der()));
+    }
+
+    [[nodiscard]] const std::string& did_prefix() const
+    {
+      return prefix;
+    }
+
+    /// The DID for the given policies, in order.
+    [[nodiscard]] std::string make(const std::vector<DidPolicy>& policies) const
+    {
+      if (policies.empty())
+      {
+        throw std::invalid_argument("at least one policy is required");
+      }
+
+      std::string r;
+      r.reserve(prefix.size() + 64 * policies.size());
+      r += prefix;
+      for (const auto& policy : policies)
+      {
+        append(r, policy);
+      }
+      return r;
+    }
+
+    /// One DID per element of policy_sets, e.g. one per leaf.
+    [[nodiscard]] std::vector<std::string> make_many(
+      const std::vector<std::vector<DidPolicy>>& policy_sets) const
+    {
+      std::vector<std::string> r;
+      r.reserve(policy_sets.size());
+      for (const auto& policies : policy_sets)
+      {
+        r.push_back(make(policies));
+      }
+      return r;
+    }
+
+  private:
+    std::string prefix;
+
+    // Policy names, subject keys, SAN types and EKU OIDs are compared without
+    // unescaping by verify(), so they must consist of idchars already.
+    static void append_literal(std::string& out, const std::string& s)
+    {
+      if (s.empty() || !std::ranges::all_of(s, is_idchar))
+      {
+        throw std::invalid_argument(
+          "invalid character in DID policy name or key: '" + s + "'");
+      }
+      out += s;
+    }
+
+    static void append(std::string& out, const DidPolicy& policy)
+    {
+      out += "::";
+      append_literal(out, policy.name);
+
+      const auto& args = policy.args;
+      if (policy.name == "subject")
+      {
+        if (args.empty() || args.size() % 2 != 0)
+        {
+          throw std::invalid_argument("subject policy needs key-value pairs");
+        }
+        // verify() reads S as ST and rejects repeated keys.
+        std::unordered_set<std::string_view> keys;
+        for (size_t i = 0; i < args.size(); i += 2)
+        {
+          const std::string_view key =
+            args[i] == "S" ? std::string_view("ST") : std::string_view(args[i]);
+          if (!keys.insert(key).second)
+          {
+            throw std::invalid_argument(
+              "duplicate subject key: " + std::string(key));
+          }
+        }
+        for (size_t i = 0; i < args.size(); i += 2)
+        {
+          out += ':';
+          append_literal(out, args[i]);
+          out += ':';
+          percent_encode(args[i + 1], out);
+        }
+      }
+      else if (policy.name == "san")
+      {
+        if (args.size() != 2)
+        {
+          throw std::invalid_argument("san policy needs a type and a value");
+        }
+        // Throws for SAN types that verify() does not support.
+        static_cast<void>(san_gen_type(args[0]));
+        out += ':';
+        out += args[0];
+        out += ':';
+        percent_encode(args[1], out);
+      }
+      else if (policy.name == "eku")
+      {
+        if (args.size() != 1 || !encode_oid(args[0]))
+        {
+          throw std::invalid_argument("eku policy needs one dotted OID");
+        }
+        out += ':';
+        out += args[0];
+      }
+      else if (policy.name == "fulcio-issuer")
+      {
+        if (args.size() != 1)
+        {
+          throw std::invalid_argument(
+            "fulcio-issuer policy needs one issuer");
+        }
+        out += ':';
+        percent_encode(args[0], out);
+      }
+      else
+      {
+        throw std::invalid_argument(
+          "unsupported DID policy: " + policy.name);
+      }
+    }
+  };
+
+  /// The DID anchored on certificate ca_index (1 or more; the leaf is not a
+  /// valid anchor) of chain, with the given policies.
+  inline std::string make_did(
+    const UqSTACK_OF_X509& chain,
+    size_t ca_index,
+    const std::string& fingerprint_alg,
+    const std::vector<DidPolicy>& policies)
+  {
+    if (ca_index == 0 || ca_index >= chain.size())
+    {
+      throw std::out_of_range("CA index must refer to a CA of the chain");
+    }
+    return DidGenerator(chain.at(ca_index), fingerprint_alg).make(policies);
+  }
+
+  namespace
+  {
+    enum class StaticPolicyKind
+    {
+      subject,
+      san,
+      eku,
+      fulcio_issuer,
+    };
+
+    /// A did:x509 DID parsed and validated at compile time. Policy arguments
+    /// are stored back to back in `text`, percent-decoded where the runtime
+    /// parser decodes them; N, the length of the DID, bounds every count.
+    template <size_t N>
+    struct StaticDidSpec
+    {
+      struct Arg
+      {
+        size_t offset = 0;
+        size_t size = 0;
+      };
+
+      struct Policy
+      {
+        StaticPolicyKind kind = StaticPolicyKind::subject;
+        size_t first_arg = 0;
+        size_t arg_count = 0;
+        int san_type = 0;
+        OidBytes oid{};
+      };
+
+      size_t fingerprint_slot = 0;
+      std::array<uint8_t, 64> fingerprint{};
+      size_t fingerprint_size = 0;
+      std::array<char, N> text{};
+      size_t text_size = 0;
+      std::array<Arg, N> args{};
+      size_t arg_count = 0;
+      std::array<Policy, N> policies{};
+      size_t policy_count = 0;
+
+      [[nodiscard]] constexpr std::string_view arg(size_t i) const
+      {
+        return {text.data() + args[i].offset, args[i].size};
+      }
+
+      /// Appends an argument, percent-decoding it if `unescape` is set.
+      constexpr void add_arg(std::string_view value, bool unescape)
+      {
+        const size_t offset = text_size;
+        for (size_t i = 0; i < value.size(); i++)
+        {
+          char c = value[i];
+          if (
+            unescape && c == '%' && i + 2 < value.size() &&
+            hex_digit_values[static_cast<uint8_t>(value[i + 1])] >= 0 &&
+            hex_digit_values[static_cast<uint8_t>(value[i + 2])] >= 0)
+          {
+            c = static_cast<char>(
+              hex_digit_values[static_cast<uint8_t>(value[i + 1])] << 4 |
+              hex_digit_values[static_cast<uint8_t>(value[i + 2])]);
+            i += 2;
+          }
+          text[text_size++] = c;
+        }
+        args[arg_count++] = {offset, text_size - offset};
+      }
+    };
+
+    constexpr int base64url_digit(char c)
+    {
+      return c >= 'A' && c <= 'Z' ? c - 'A' :
+        c >= 'a' && c <= 'z'      ? c - 'a' + 26 :
+        c >= '0' && c <= '9'      ? c - '0' + 52 :
+        c == '-'                  ? 62 :
+        c == '_'                  ? 63 :
+                                    -1;
+    }
+
+    constexpr int static_san_type(std::string_view san_type)
+    {
+      return san_type == "dns" ? GEN_DNS :
+        san_type == "email"    ? GEN_EMAIL :
+        san_type == "uri"      ? GEN_URI :
+                                 -1;
+    }
+
+    template <size_t N>
+    constexpr void parse_static_policy(
+      StaticDidSpec<N>& r, std::string_view policy)
+    {
+      const auto name_end = policy.find(':');
+      if (name_end == std::string_view::npos)
+      {
+        throw std::invalid_argument("invalid policy");
+      }
+      const auto name = policy.substr(0, name_end);
+      auto rest = policy.substr(name_end + 1);
+
+      std::array<std::string_view, N> args{};
+      size_t arg_count = 0;
+      while (true)
+      {
+        const auto end = rest.find(':');
+        args[arg_count++] = rest.substr(0, end);
+        if (end == std::string_view::npos)
+        {
+          break;
+        }
+        rest = rest.substr(end + 1);
+      }
+
+      auto& p = r.policies[r.policy_count++];
+      p.first_arg = r.arg_count;
+      if (name == "subject")
+      {
+        p.kind = StaticPolicyKind::subject;
+        if (arg_count % 2 != 0)
+        {
+          throw std::invalid_argument("key-value pairs required");
+        }
+        if (arg_count < 2)
+        {
+          throw std::invalid_argument(
+            "at least one key-value pair is required");
+        }
+        for (size_t j = 0; j < arg_count; j += 2)
+        {
+          // See check_policy() for why S is read as ST.
+          const auto key = args[j] == "S" ? std::string_view("ST") : args[j];
+          for (size_t k = 0; k < j; k += 2)
+          {
+            if (r.arg(p.first_arg + k) == key)
+            {
+              throw std::invalid_argument("duplicate subject field");
+            }
+          }
+          r.add_arg(key, false);
+          r.add_arg(args[j + 1], true);
+        }
+      }
+      else if (name == "san")
+      {
+        p.kind = StaticPolicyKind::san;
+        if (arg_count != 2)
+        {
+          throw std::invalid_argument(
+            "exactly one SAN type and value required");
+        }
+        p.san_type = static_san_type(args[0]);
+        if (p.san_type < 0)
+        {
+          throw std::invalid_argument("unknown SAN type");
+        }
+        r.add_arg(args[1], true);
+      }
+      else if (name == "eku")
+      {
+        p.kind = StaticPolicyKind::eku;
+        if (arg_count != 1)
+        {
+          throw std::invalid_argument("exactly one EKU required");
+        }
+        const auto oid = encode_oid(args[0]);
+        if (!oid)
+        {
+          throw std::invalid_argument("invalid EKU OID");
+        }
+        p.oid = *oid;
+        r.add_arg(args[0], false);
+      }
+      else if (name == "fulcio-issuer")
+      {
+        p.kind = StaticPolicyKind::fulcio_issuer;
+        if (arg_count != 1)
+        {
+          throw std::invalid_argument("excessive arguments to fulcio-issuer");
+        }
+        r.add_arg(args[0], true);
+      }
+      else
+      {
+        throw std::invalid_argument("unsupported did:x509 scheme");
+      }
+      p.arg_count = r.arg_count - p.first_arg;
+    }
+
+    /// Parses and validates a DID like parse_did() and check_policy() do at
+    /// runtime. Only called in constant expressions, where the throws turn
+    /// a malformed DID into a compile error.
+    template <size_t N>
+    consteval StaticDidSpec<N> parse_static_did(std::string_view did)
+    {
+      StaticDidSpec<N> r;
+
+      constexpr std::string_view prefix = "did:x509:0:";
+      if (!did.starts_with(prefix))
+      {
+        throw std::invalid_argument("unsupported method/prefix");
+      }
+      auto rest = did.substr(prefix.size());
+
+      const auto alg_end = rest.find(':');
+      const auto alg = rest.substr(0, alg_end);
+      if (alg == "sha256")
+      {
+        r.fingerprint_slot = 0;
+        r.fingerprint_size = 32;
+      }
+      else if (alg == "sha384")
+      {
+        r.fingerprint_slot = 1;
+        r.fingerprint_size = 48;
+      }
+      else if (alg == "sha512")
+      {
+        r.fingerprint_slot = 2;
+        r.fingerprint_size = 64;
+      }
+      else
+      {
+        throw std::invalid_argument("unsupported fingerprint algorithm");
+      }
+      rest = rest.substr(alg_end + 1);
+
+      const auto fingerprint_end = rest.find("::");
+      if (fingerprint_end == std::string_view::npos)
+      {
+        throw std::invalid_argument("invalid DID string");
+      }
+      // Unpadded base64url; the unused low bits of the last digit must be
+      // zero, or no certificate could ever match.
+      const auto fingerprint = rest.substr(0, fingerprint_end);
+      if (fingerprint.size() != (r.fingerprint_size * 8 + 5) / 6)
+      {
+        throw std::invalid_argument("invalid certificate fingerprint");
+      }
+      uint32_t acc = 0;
+      size_t bits = 0;
+      size_t out = 0;
+      for (const char c : fingerprint)
+      {
+        const int v = base64url_digit(c);
+        if (v < 0)
+        {
+          throw std::invalid_argument("invalid certificate fingerprint");
+        }
+        acc = (acc << 6 | static_cast<uint32_t>(v)) & 0xFFF;
+        bits += 6;
+        if (bits >= 8)
+        {
+          bits -= 8;
+          r.fingerprint[out++] = static_cast<uint8_t>(acc >> bits);
+        }
+      }
+      if ((acc & ((1u << bits) - 1)) != 0)
+      {
+        throw std::invalid_argument("invalid certificate fingerprint");
+      }
+      rest = rest.substr(fingerprint_end + 2);
+
+      while (true)
+      {
+        const auto end = rest.find("::");
+        parse_static_policy(r, rest.substr(0, end));
+        if (end == std::string_view::npos)
+        {
+          break;
+        }
+        rest = rest.substr(end + 2);
+      }
+      return r;
+    }
+  }
+
+  /// A string literal usable as a template argument, see StaticDid.
+  template <size_t N>
+  struct FixedString
+  {
+    char chars[N] = {};
+
+    constexpr FixedString(const char (&s)[N])
+    {
+      std::copy_n(s, N, chars);
+    }
+
+    [[nodiscard]] static constexpr size_t size()
+    {
+      return N - 1;
+    }
+
+    [[nodiscard]] constexpr std::string_view view() const
+    {
+      return {chars, N - 1};
+    }
+  };
+
+  /// A DID fixed at build time, e.g. a pinned release-signing identity:
+  ///
+  ///   using Release = StaticDid<"did:x509:0:sha256:...::eku:...">;
+  ///   const auto doc = Release::resolve(pem_chain);
+  ///
+  /// The DID is parsed and validated at compile time, so a malformed DID
+  /// fails the build. The fingerprint is decoded to bytes and policy values
+  /// are percent-decoded in advance. verify() checks each policy with code
+  /// specialised for it and does no parsing at runtime. Accept/reject
+  /// decisions and error messages match those for the same DID given as a
+  /// string.
+  template <FixedString Did>
+  class StaticDid
+  {
+    static constexpr auto spec = parse_static_did<Did.size()>(Did.view());
+
+  public:
+    static constexpr std::string_view did = Did.view();
+
+    /// Throws unless the (already verified) chain matches the DID.
+    static void verify(
+      const UqSTACK_OF_X509& valid_chain, const Limits& limits = {})
+    {
+      check_limits(limits);
+      check_fingerprint(valid_chain);
+      LeafContext leaf(valid_chain.at(0));
+      [&]<size_t... I>(std::index_sequence<I...>) {
+        (check_policy<I>(leaf, limits), ...);
+      }(std::make_index_sequence<spec.policy_count>{});
+    }
+
+    static UqSTACK_OF_X509 resolve_chain(
+      const UqSTACK_OF_X509& chain,
+      bool ignore_time = false,
+      const Limits& limits = {})
+    {
+      if (chain.empty())
+      {
+        throw std::runtime_error("no certificate chain");
+      }
+      check_limits(limits);
+      std::vector<UqX509> roots;
+      roots.emplace_back(chain.back());
+      auto valid_chain = chain.verify(roots, ignore_time, true, limits);
+      verify(valid_chain, limits);
+      return valid_chain;
+    }
+
+    static UqSTACK_OF_X509 resolve_chain(
+      const UqSTACK_OF_X509& chain,
+      std::chrono::system_clock::time_point at,
+      const Limits& limits = {})
+    {
+      if (chain.empty())
+      {
+        throw std::runtime_error("no certificate chain");
+      }
+      check_limits(limits);
+      std::vector<UqX509> roots;
+      roots.emplace_back(chain.back());
+      auto valid_chain = chain.verify(roots, at, true, limits);
+      verify(valid_chain, limits);
+      return valid_chain;
+    }
+
+    static std::string resolve(
+      const std::string& chain_pem,
+      bool ignore_time = false,
+      const Limits& limits = {})
+    {
+      check_limits(limits);
+      const UqSTACK_OF_X509 chain(chain_pem, limits);
+      return create_did_document(
+        std::string(did), resolve_chain(chain, ignore_time, limits));
+    }
+
+    static std::string resolve(
+      const std::string& chain_pem,
+      std::chrono::system_clock::time_point at,
+      const Limits& limits = {})
+    {
+      check_limits(limits);
+      const UqSTACK_OF_X509 chain(chain_pem, limits);
+      return create_did_document(
+        std::string(did), resolve_chain(chain, at, limits));
+    }
+
+  private:
+    /// The runtime Limits still apply; only the counts are known in advance.
+    static void check_limits(const Limits& limits)
+    {
+      if (did.size() > limits.max_did_bytes)
+      {
+        throw std::runtime_error("DID too long");
+      }
+      if (spec.policy_count > limits.max_policies)
+      {
+        throw std::runtime_error("too many policies");
+      }
+    }
+
+    static void check_fingerprint(const UqSTACK_OF_X509& chain)
+    {
+      StageScope stage(Stage::check_fingerprint);
+
+      constexpr HashFunction hashes[] = {sha256, sha384, sha512};
+      constexpr auto hash = hashes[spec.fingerprint_slot];
+      for (size_t i = 1; i < chain.size(); i++)
+      {
+        const auto digest = hash(chain.at(i).der());
+        if (std::equal(
+              digest.begin(),
+              digest.end(),
+              spec.fingerprint.begin(),
+              spec.fingerprint.begin() + spec.fingerprint_size))
+        {
+          return;
+        }
+      }
+
+      stage.fail(ErrorCategory::fingerprint_mismatch);
+      throw std::runtime_error("invalid certificate fingerprint");
+    }
+
+    template <size_t I>
+    static void check_policy(LeafContext& leaf, const Limits& limits)
+    {
+      constexpr const auto& policy = spec.policies[I];
+
+      if constexpr (policy.kind == StaticPolicyKind::subject)
+      {
+        StageScope stage(Stage::policy, PolicyType::subject);
+
+        if (policy.arg_count / 2 > limits.max_subject_pairs)
+        {
+          throw std::runtime_error("too many subject key-value pairs");
+        }
+
+        const auto subject = leaf.cert().subject();
+        for (size_t j = 0; j < policy.arg_count; j += 2)
+        {
+          const auto key = spec.arg(policy.first_arg + j);
+          const auto value = spec.arg(policy.first_arg + j + 1);
+          const auto sit = subject.find(std::string(key));
+          if (sit == subject.end())
+          {
+            stage.fail(ErrorCategory::subject_mismatch);
+            throw std::runtime_error(
+              "unsupported subject key: '" + std::string(key) + "'");
+          }
+          if (
+            std::find(sit->second.begin(), sit->second.end(), value) ==
+            sit->second.end())
+          {
+            stage.fail(ErrorCategory::subject_mismatch);
+            throw std::runtime_error(
+              "invalid subject key/value: " + std::string(key) + "=" +
+              std::string(value));
+          }
+        }
+      }
+      else if constexpr (policy.kind == StaticPolicyKind::san)
+      {
+        StageScope stage(Stage::policy, PolicyType::san);
+
+        constexpr auto value = spec.arg(policy.first_arg);
+        if (!leaf.sans(limits.max_san_entries).contains(policy.san_type, value))
+        {
+          stage.fail(ErrorCategory::san_not_found);
+          throw std::runtime_error("SAN not found: " + std::string(value));
+        }
+      }
+      else if constexpr (policy.kind == StaticPolicyKind::eku)
+      {
+        StageScope stage(Stage::policy, PolicyType::eku);
+
+        const EkuView ekus(leaf.extensions(), limits.max_eku_entries);
+        if (!ekus.contains(policy.oid))
+        {
+          stage.fail(ErrorCategory::eku_not_found);
+          throw std::runtime_error(
+            "EKU not found: " + std::string(spec.arg(policy.first_arg)));
+        }
+      }
+      else
+      {
+        StageScope stage(Stage::policy, PolicyType::fulcio_issuer);
+
+        constexpr auto value = spec.arg(policy.first_arg);
+        if (!leaf.has_fulcio_issuer(value))
+        {
+          stage.fail(ErrorCategory::fulcio_issuer_mismatch);
+          throw std::runtime_error(
+            "invalid fulcio-issuer: https://" + std::string(value));
+        }
+      }
+    }
+  };
+
+  inline std::string resolve(
+    const std::string& chain_pem,
+    const std::string& did,
+    bool ignore_time = false,
+    const Limits& limits = {},
+    Evaluation evaluation = Evaluation::strict)
+  {
+    check_did_limits(did, limits);
+    const UqSTACK_OF_X509 chain(chain_pem, limits);
+
+    const auto valid_chain =
+      resolve_chain(chain, did, ignore_time, limits, evaluation);
+    return create_did_document(did, valid_chain);
+  }
+
+  inline std::string resolve(
+    const std::string& chain_pem,
+    const std::string& did,
+    std::chrono::system_clock::time_point at,
+    const Limits& limits = {},
+    Evaluation evaluation = Evaluation::strict)
+  {
+    check_did_limits(did, limits);
+    const UqSTACK_OF_X509 chain(chain_pem, limits);
+
+    const auto valid_chain =
+      resolve_chain(chain, did, at, limits, evaluation);
+    return create_did_document(did, valid_chain);
+  }
+
+  /// Resolves against a bundle of trust anchors, instead of trusting the
+  /// last certificate of the presented chain.
+  inline UqSTACK_OF_X509 resolve_chain(
+    const UqSTACK_OF_X509& chain,
+    const std::string& did,
+    const TrustBundle& anchors,
+    bool ignore_time = false,
+    const Limits& limits = {})
+  {
+    if (chain.empty())
+    {
+      throw std::runtime_error("no certificate chain");
+    }
+    check_did_limits(did, limits);
+
+    auto valid_chain = anchors.verify(chain, ignore_time, limits);
+    verify(valid_chain, did, limits);
+    return valid_chain;
+  }
+
+  inline UqSTACK_OF_X509 resolve_chain(
+    const UqSTACK_OF_X509& chain,
+    const std::string& did,
+    const TrustBundle& anchors,
+    std::chrono::system_clock::time_point at,
+    const Limits& limits = {})
+  {
+    if (chain.empty())
+    {
+      throw std::runtime_error("no certificate chain");
+    }
+    check_did_limits(did, limits);
+
+    auto valid_chain = anchors.verify(chain, at, limits);
+    verify(valid_chain, did, limits);
+    return valid_chain;
+  }
+
+  inline std::string resolve(
+    const std::string& chain_pem,
+    const std::string& did,
+    const TrustBundle& anchors,
+    bool ignore_time = false,
+    const Limits& limits = {})
+  {
+    check_did_limits(did, limits);
+    const UqSTACK_OF_X509 chain(chain_pem, limits);
+
+    return create_did_document(
+      did, resolve_chain(chain, did, anchors, ignore_time, limits));
+  }
+
+  inline std::string resolve(
+    const std::string& chain_pem,
+    const std::string& did,
+    const TrustBundle& anchors,
+    std::chrono::system_clock::time_point at,
+    const Limits& limits = {})
+  {
+    check_did_limits(did, limits);
+    const UqSTACK_OF_X509 chain(chain_pem, limits);
+
+    return create_did_document(
+      did, resolve_chain(chain, did, anchors, at, limits));
+  }
+
+  inline std::string resolve_jwk(
+    const std::vector<std::string>& chain_pem,
+    const std::string& did,
+    bool ignore_time = false,
+    const Limits& limits = {},
+    Evaluation evaluation = Evaluation::strict)
+  {
+    check_did_limits(did, limits);
+    const UqSTACK_OF_X509 chain(chain_pem, limits);
+
+    const auto valid_chain =
+      resolve_chain(chain, did, ignore_time, limits, evaluation);
+    const auto& leaf = valid_chain.front();
+    is_agreed_signature_key(leaf);
+
+    return leaf.public_jwk();
+  }
+
+  inline std::string resolve_jwk(
+    const std::vector<std::string>& chain_pem,
+    const std::string& did,
+    std::chrono::system_clock::time_point at,
+    const Limits& limits = {},
+    Evaluation evaluation = Evaluation::strict)
+  {
+    check_did_limits(did, limits);
+    const UqSTACK_OF_X509 chain(chain_pem, limits);
+
+    const auto valid_chain =
+      resolve_chain(chain, did, at, limits, evaluation);
+    const auto& leaf = valid_chain.front();
+    is_agreed_signature_key(leaf);
+
+    return leaf.public_jwk();
+  }
+
+  /// Like resolve_jwk(), for certificates given as views, e.g. slices of a
+  /// received message, so that they need not be copied into strings first.
+  inline std::string resolve_jwk(
+    std::span<const std::string_view> chain_pem,
+    const std::string& did,
+    bool ignore_time = false,
+    const Limits& limits = {},
+    Evaluation evaluation = Evaluation::strict)
+  {
+    check_did_limits(did, limits);
+    const UqSTACK_OF_X509 chain(chain_pem, limits);
+
+    const auto valid_chain =
+      resolve_chain(chain, did, ignore_time, limits, evaluation);
+    const auto& leaf = valid_chain.front();
+    is_agreed_signature_key(leaf);
+
+    return leaf.public_jwk();
+  }
+
+  inline std::string resolve_jwk(
+    std::span<const std::string_view> chain_pem,
+    const std::string& did,
+    std::chrono::system_clock::time_point at,
+    const Limits& limits = {},
+    Evaluation evaluation = Evaluation::strict)
+  {
+    check_did_limits(did, limits);
+    const UqSTACK_OF_X509 chain(chain_pem, limits);
+
+    const auto valid_chain =
+      resolve_chain(chain, did, at, limits, evaluation);
+    const auto& leaf = valid_chain.front();
+    is_agreed_signature_key(leaf);
+
+    return leaf.public_jwk();
+  }
+
+  /// Like resolve_jwk(), for certificates stored in one buffer: certificate
+  /// i is buffer[offsets[i], offsets[i + 1]). Throws std::out_of_range if
+  /// the offsets decrease or run past the end of the buffer.
+  inline std::string resolve_jwk(
+    std::string_view buffer,
+    std::span<const size_t> offsets,
+    const std::string& did,
+    bool ignore_time = false,
+    const Limits& limits = {},
+    Evaluation evaluation = Evaluation::strict)
+  {
+    return resolve_jwk(
+      pem_slices(buffer, offsets), did, ignore_time, limits, evaluation);
+  }
+
+  inline std::string resolve_jwk(
+    std::string_view buffer,
+    std::span<const size_t> offsets,
+    const std::string& did,
+    std::chrono::system_clock::time_point at,
+    const Limits& limits = {},
+    Evaluation evaluation = Evaluation::strict)
+  {
+    return resolve_jwk(
+      pem_slices(buffer, offsets), did, at, limits, evaluation);
+  }
+
+  /// A DID document together with the Sigstore claims of the leaf it was
+  /// resolved from.
+  struct FulcioResolution
+  {
+    std::string did_document;
+    FulcioClaims claims;
+  };
+
+  /// Resolves like resolve() and additionally decodes the leaf's Fulcio
+  /// claims, so callers verifying Sigstore signatures do not need to parse
+  /// the certificate a second time.
+  inline FulcioResolution resolve_fulcio(
+    const std::string& chain_pem,
+    const std::string& did,
+    bool ignore_time = false,
+    const Limits& limits = {},
+    Evaluation evaluation = Evaluation::strict)
+  {
+    check_did_limits(did, limits);
+    const UqSTACK_OF_X509 chain(chain_pem, limits);
+
+    const auto valid_chain =
+      resolve_chain(chain, did, ignore_time, limits, evaluation);
+    return {
+      create_did_document(did, valid_chain),
+      valid_chain.front().fulcio_claims()};
+  }
+
+  inline FulcioResolution resolve_fulcio(
+    const std::string& chain_pem,
+    const std::string& did,
+    std::chrono::system_clock::time_point at,
+    const Limits& limits = {},
+    Evaluation evaluation = Evaluation::strict)
+  {
+    check_did_limits(did, limits);
+    const UqSTACK_OF_X509 chain(chain_pem, limits);
+
+    const auto valid_chain =
+      resolve_chain(chain, did, at, limits, evaluation);
+    return {
+      create_did_document(did, valid_chain),
+      valid_chain.front().fulcio_claims()};
+  }
+
+  namespace
+  {
+    using Sha256Digest = std::array<uint8_t, 32>;
+
+    inline Sha256Digest sha256_digest(std::span<const uint8_t> data)
+    {
+      Sha256Digest r;
+      unsigned int size = 0;
+      CHECK1(EVP_Digest(
+        data.data(),
+        data.size(),
+        r.data(),
+        &size,
+        Digests::get().sha256,
+        nullptr));
+      return r;
+    }
+
+    inline Sha256Digest sha256_digest(std::string_view data)
+    {
+      return sha256_digest(
+        std::span<const uint8_t>((const uint8_t*)data.data(), data.size()));
+    }
+
+    /// SHA-256 over the DER encodings of a chain's certificates, in order.
+    inline Sha256Digest chain_digest(const UqSTACK_OF_X509& chain)
+    {
+      std::vector<uint8_t> der;
+      for (size_t i = 0; i < chain.size(); i++)
+      {
+        const auto cert = chain.at(i).der();
+        der.insert(der.end(), cert.begin(), cert.end());
+      }
+      return sha256_digest(der);
+    }
+
+    struct PemChainDigest
+    {
+      /// As chain_digest().
+      Sha256Digest chain;
+      /// SHA-256 of the last certificate's DER.
+      Sha256Digest last;
+    };
+
+    /// As chain_digest(), but computed by only base64-decoding the PEM
+    /// elements. Returns std::nullopt unless each element is canonical PEM
+    /// (see decode_pem_certificates) and, with `one_per_element`, holds
+    /// exactly one certificate.
+    inline std::optional<PemChainDigest> pem_chain_digest(
+      std::span<const std::string_view> elements, bool one_per_element)
+    {
+      std::vector<uint8_t> der;
+      std::vector<uint8_t> arena;
+      std::vector<std::pair<size_t, size_t>> blocks;
+      std::pair<size_t, size_t> last;
+      for (const auto element : elements)
+      {
+        blocks.clear();
+        if (
+          !decode_pem_certificates(element, arena, blocks) ||
+          blocks.empty() || (one_per_element && blocks.size() != 1))
+        {
+          return std::nullopt;
+        }
+        last = {der.size() + blocks.back().first, blocks.back().second};
+        der.insert(der.end(), arena.begin(), arena.end());
+      }
+      if (der.empty())
+      {
+        return std::nullopt;
+      }
+      return PemChainDigest{
+        sha256_digest(der),
+        sha256_digest(
+          std::span<const uint8_t>(der).subspan(last.first, last.second))};
+    }
+
+    /// SHA-256 over every member of `limits`, identifying the Limits a
+    /// resolution cache snapshot was made with.
+    inline Sha256Digest limits_digest(const Limits& limits)
+    {
+      // Update the list below when adding members to Limits.
+      static_assert(sizeof(Limits) == 7 * sizeof(size_t));
+      std::vector<uint8_t> bytes;
+      for (const uint64_t value :
+           {limits.max_pem_bytes,
+            limits.max_certificates,
+            limits.max_did_bytes,
+            limits.max_policies,
+            limits.max_subject_pairs,
+            limits.max_san_entries,
+            limits.max_eku_entries})
+      {
+        for (size_t i = 0; i < sizeof(value); i++)
+        {
+          bytes.push_back(static_cast<uint8_t>(value >> (8 * i)));
+        }
+      }
+      return sha256_digest(bytes);
+    }
+
+    inline std::chrono::system_clock::time_point to_time_point(
+      const ASN1_TIME* time)
+    {
+      std::tm tm = {};
+      CHECK1(ASN1_TIME_to_tm(time, &tm));
+      const std::chrono::year_month_day date(
+        std::chrono::year(tm.tm_year + 1900),
+        std::chrono::month(tm.tm_mon + 1),
+        std::chrono::day(tm.tm_mday));
+      return std::chrono::sys_days(date) + std::chrono::hours(tm.tm_hour) +
+        std::chrono::minutes(tm.tm_min) + std::chrono::seconds(tm.tm_sec);
+    }
+  }
+
+  /// A cache of resolution results for use in front of resolve() and
+  /// resolve_jwk(), keyed by the SHA-256 of the presented chain's DER and
+  /// the DID. Only successful resolutions at the current time are cached,
+  /// and an entry is served only while every certificate of its verified
+  /// chain is within its validity period. On a hit, a chain in canonical PEM
+  /// is only base64-decoded and hashed, not parsed or verified. The least
+  /// recently used entries are evicted beyond `max_entries`.
+  ///
+  /// save() snapshots the cache to a compact, versioned file, which load()
+  /// memory-maps to warm up a new process. Snapshots of a cache with other
+  /// Limits are skipped, and load() checks every entry again: expired
+  /// entries are dropped, and so are entries whose trust anchor is no
+  /// longer in the TrustBundle the cache is bound to. Without a
+  /// TrustBundle, an entry is only served for a chain whose last
+  /// certificate is the entry's trust anchor.
+  ///
+  /// Loaded entries are served without verification, so a snapshot is as
+  /// trusted as configuration: anyone who can write it can make the cache
+  /// return any document or JWK. Store snapshots where only the service
+  /// can write them. The trailing SHA-256 only detects accidental
+  /// corruption such as truncation or bit flips; it is not a MAC.
+  ///
+  /// All members are thread-safe.
+  class ResolutionCache
+  {
+  public:
+    static constexpr uint32_t file_version = 2;
+
+    explicit ResolutionCache(
+      size_t max_entries = 64 * 1024, const Limits& limits = {}) :
+      max_entries(max_entries),
+      limits(limits)
+    {}
+
+    /// A cache whose misses are resolved against `anchors` instead of the
+    /// last certificate of the presented chain. The bundle must outlive the
+    /// cache.
+    explicit ResolutionCache(
+      const TrustBundle& anchors,
+      size_t max_entries = 64 * 1024,
+      const Limits& limits = {}) :
+      anchors(&anchors),
+      max_entries(max_entries),
+      limits(limits)
+    {}
+
+    ResolutionCache(const ResolutionCache&) = delete;
+    ResolutionCache& operator=(const ResolutionCache&) = delete;
+
+    /// As didx509::resolve(chain_pem, did) at the current time.
+    std::string resolve(const std::string& chain_pem, const std::string& did)
+    {
+      std::optional<PemChainDigest> digest;
+      if (chain_pem.size() <= limits.max_pem_bytes)
+      {
+        const std::string_view element = chain_pem;
+        digest = pem_chain_digest({&element, 1}, false);
+      }
+      if (digest)
+      {
+        if (auto hit = find(Kind::document, *digest, did))
+        {
+          return std::move(*hit);
+        }
+      }
+      misses_count++;
+
+      check_did_limits(did, limits);
+      const UqSTACK_OF_X509 chain(chain_pem, limits);
+      const auto valid_chain = resolve_chain(chain, did);
+      auto document = create_did_document(did, valid_chain);
+      insert(
+        Kind::document,
+        digest ? digest->chain : chain_digest(chain),
+        did,
+        document,
+        valid_chain);
+      return document;
+    }
+
+    /// As didx509::resolve_jwk(chain_pem, did) at the current time.
+    std::string resolve_jwk(
+      const std::vector<std::string>& chain_pem, const std::string& did)
+    {
+      std::optional<PemChainDigest> digest;
+      size_t total = 0;
+      for (const auto& element : chain_pem)
+      {
+        total += element.size();
+      }
+      if (
+        total <= limits.max_pem_bytes &&
+        chain_pem.size() <= limits.max_certificates)
+      {
+        std::vector<std::string_view> elements(
+          chain_pem.begin(), chain_pem.end());
+        digest = pem_chain_digest(elements, true);
+      }
+      if (digest)
+      {
+        if (auto hit = find(Kind::jwk, *digest, did))
+        {
+          return std::move(*hit);
+        }
+      }
+      misses_count++;
+
+      check_did_limits(did, limits);
+      const UqSTACK_OF_X509 chain(chain_pem, limits);
+      const auto valid_chain = resolve_chain(chain, did);
+      const auto leaf = valid_chain.front();
+      is_agreed_signature_key(leaf);
+      auto jwk = leaf.public_jwk();
+      insert(
+        Kind::jwk,
+        digest ? digest->chain : chain_digest(chain),
+        did,
+        jwk,
+        valid_chain);
+      return jwk;
+    }
+
+    [[nodiscard]] size_t size() const
+    {
+      const std::lock_guard<std::mutex> lock(mutex);
+      return entries.size();
+    }
+
+    [[nodiscard]] uint64_t hits() const
+    {
+      return hits_count.load();
+    }
+
+    [[nodiscard]] uint64_t misses() const
+    {
+      return misses_count.load();
+    }
+
+    void clear()
+    {
+      const std::lock_guard<std::mutex> lock(mutex);
+      index.clear();
+      entries.clear();
+    }
+
+    /// Writes all entries to `path`, most recently used first. The file is
+    /// written next to `path` and renamed over it, so readers never see a
+    /// partial snapshot.
+    void save(const std::string& path) const
+    {
+      std::string out(magic);
+      put(out, file_version);
+      put(out, static_cast<uint32_t>(anchors != nullptr));
+      const auto limits_id = limits_digest(limits);
+      out.append((const char*)limits_id.data(), digest_size);
+      {
+        const std::lock_guard<std::mutex> lock(mutex);
+        put(out, static_cast<uint64_t>(entries.size()));
+        for (const auto& [key, entry] : entries)
+        {
+          const auto did = std::string_view(key).substr(1 + digest_size);
+          out.append(key, 0, 1 + digest_size);
+          out.append((const char*)entry.anchor.data(), digest_size);
+          put(out, static_cast<uint64_t>(entry.not_before));
+          put(out, static_cast<uint64_t>(entry.not_after));
+          put(out, static_cast<uint32_t>(did.size()));
+          put(out, static_cast<uint32_t>(entry.value.size()));
+          out.append(did);
+          out.append(entry.value);
+        }
+      }
+      const auto checksum = sha256_digest(out);
+      out.append((const char*)checksum.data(), digest_size);
+
+      const std::string tmp = path + ".tmp";
+      {
+        std::ofstream f(tmp, std::ios::binary | std::ios::trunc);
+        f.write(out.data(), static_cast<std::streamsize>(out.size()));
+        if (!f.flush())
+        {
+          throw std::runtime_error("could not write " + tmp);
+        }
+      }
+      if (std::rename(tmp.c_str(), path.c_str()) != 0)
+      {
+        std::remove(tmp.c_str());
+        throw std::runtime_error("could not write " + path);
+      }
+    }
+
+    /// Adds the entries of a snapshot written by save() that are still
+    /// valid at `now` and, for a cache bound to a TrustBundle, whose trust
+    /// anchor is still in it. Snapshots of a cache with a different trust
+    /// model or different Limits contribute nothing. Existing entries are
+    /// kept. Returns the number of entries added. Throws if the file is not
+    /// a snapshot or is corrupt. `path` must be trusted, see above.
+    size_t load(
+      const std::string& path,
+      std::chrono::system_clock::time_point now =
+        std::chrono::system_clock::now())
+    {
+      const MappedFile file(path);
+      std::string_view in = file.view();
+
+      if (!in.starts_with(magic))
+      {
+        throw std::runtime_error("invalid resolution cache file");
+      }
+      in.remove_prefix(magic.size());
+      if (get<uint32_t>(in) != file_version)
+      {
+        throw std::runtime_error("unsupported resolution cache version");
+      }
+      // The checksum covers everything before it, header included.
+      if (in.size() < digest_size)
+      {
+        throw std::runtime_error("invalid resolution cache file");
+      }
+      const auto checksum = as_digest(in.substr(in.size() - digest_size));
+      in.remove_suffix(digest_size);
+      const auto all = file.view();
+      if (sha256_digest(all.substr(0, all.size() - digest_size)) != checksum)
+      {
+        throw std::runtime_error("invalid resolution cache file");
+      }
+
+      const bool bound = get<uint32_t>(in) != 0;
+      if (as_digest(take(in, digest_size)) != limits_digest(limits))
+      {
+        return 0;
+      }
+      const auto count = get<uint64_t>(in);
+      const auto t = to_seconds(now);
+
+      size_t added = 0;
+      for (uint64_t i = 0; i < count; i++)
+      {
+        const auto key_prefix = take(in, 1 + digest_size);
+        if (
+          key_prefix[0] != static_cast<char>(Kind::document) &&
+          key_prefix[0] != static_cast<char>(Kind::jwk))
+        {
+          throw std::runtime_error("invalid resolution cache file");
+        }
+        Entry entry;
+        entry.anchor = as_digest(take(in, digest_size));
+        entry.not_before = static_cast<int64_t>(get<uint64_t>(in));
+        entry.not_after = static_cast<int64_t>(get<uint64_t>(in));
+        const auto did_size = get<uint32_t>(in);
+        const auto value_size = get<uint32_t>(in);
+        const auto did = take(in, did_size);
+        entry.value = take(in, value_size);
+
+        if (
+          bound != (anchors != nullptr) || t < entry.not_before ||
+          t > entry.not_after ||
+          (anchors != nullptr && !anchors->contains(entry.anchor)))
+        {
+          continue;
+        }
+        std::string key(key_prefix);
+        key.append(did);
+
+        const std::lock_guard<std::mutex> lock(mutex);
+        if (entries.size() >= max_entries || index.contains(key))
+        {
+          continue;
+        }
+        entries.emplace_back(std::move(key), std::move(entry));
+        index.emplace(entries.back().first, std::prev(entries.end()));
+        added++;
+      }
+      if (!in.empty())
+      {
+        throw std::runtime_error("invalid resolution cache file");
+      }
+      return added;
+    }
+
+  private:
+    enum class Kind : uint8_t
+    {
+      document,
+      jwk,
+    };
+
+    struct Entry
+    {
+      std::string value;
+      /// Validity period of the verified chain, in seconds since the epoch.
+      int64_t not_before = 0;
+      int64_t not_after = 0;
+      /// SHA-256 fingerprint of the chain's trust anchor.
+      Sha256Digest anchor{};
+    };
+
+    /// Entries, most recently used first, keyed by the kind, the chain
+    /// digest and the DID.
+    using Entries = std::list<std::pair<std::string, Entry>>;
+
+    static constexpr std::string_view magic = "DIDX509C";
+    static constexpr size_t digest_size = std::tuple_size_v<Sha256Digest>;
+
+    static int64_t to_seconds(std::chrono::system_clock::time_point t)
+    {
+      return std::chrono::duration_cast<std::chrono::seconds>(
+               t.time_since_epoch())
+        .count();
+    }
+
+    static std::string make_key(
+      Kind kind, const Sha256Digest& digest, const std::string& did)
+    {
+      std::string key(1, static_cast<char>(kind));
+      key.append((const char*)digest.data(), digest.size());
+      key.append(did);
+      return key;
+    }
+
+    template <typename T>
+    static void put(std::string& out, T value)
+    {
+      for (size_t i = 0; i < sizeof(T); i++)
+      {
+        out.push_back(static_cast<char>(value >> (8 * i)));
+      }
+    }
+
+    static Sha256Digest as_digest(std::string_view bytes)
+    {
+      Sha256Digest r;
+      std::memcpy(r.data(), bytes.data(), r.size());
+      return r;
+    }
+
+    static std::string_view take(std::string_view& in, size_t n)
+    {
+      if (in.size() < n)
+      {
+        throw std::runtime_error("invalid resolution cache file");
+      }
+      const auto r = in.substr(0, n);
+      in.remove_prefix(n);
+      return r;
+    }
+
+    template <typename T>
+    static T get(std::string_view& in)
+    {
+      const auto bytes = take(in, sizeof(T));
+      T r = 0;
+      for (size_t i = 0; i < sizeof(T); i++)
+      {
+        r |= static_cast<T>(static_cast<uint8_t>(bytes[i])) << (8 * i);
+      }
+      return r;
+    }
+
+    UqSTACK_OF_X509 resolve_chain(
+      const UqSTACK_OF_X509& chain, const std::string& did) const
+    {
+      return anchors != nullptr ?
+        didx509::resolve_chain(chain, did, *anchors, false, limits) :
+        didx509::resolve_chain(chain, did, false, limits);
+    }
+
+    std::optional<std::string> find(
+      Kind kind, const PemChainDigest& digest, const std::string& did)
+    {
+      const auto key = make_key(kind, digest.chain, did);
+      const auto now = to_seconds(std::chrono::system_clock::now());
+
+      const std::lock_guard<std::mutex> lock(mutex);
+      const auto it = index.find(key);
+      if (it == index.end())
+      {
+        return std::nullopt;
+      }
+      // Without a TrustBundle the chain's last certificate is its trust
+      // anchor, so an entry recorded for another anchor does not apply.
+      const auto& entry = it->second->second;
+      if (
+        now < entry.not_before || now > entry.not_after ||
+        (anchors == nullptr && entry.anchor != digest.last))
+      {
+        entries.erase(it->second);
+        index.erase(it);
+        return std::nullopt;
+      }
+      entries.splice(entries.begin(), entries, it->second);
+      hits_count++;
+      return entry.value;
+    }
+
+    void insert(
+      Kind kind,
+      const Sha256Digest& digest,
+      const std::string& did,
+      const std::string& value,
+      const UqSTACK_OF_X509& valid_chain)
+    {
+      Entry entry;
+      entry.value = value;
+      entry.not_before = std::numeric_limits<int64_t>::min();
+      entry.not_after = std::numeric_limits<int64_t>::max();
+      for (size_t i = 0; i < valid_chain.size(); i++)
+      {
+        const X509* cert = valid_chain.at(i);
+        const auto not_before = to_time_point(X509_get0_notBefore(cert));
+        const auto not_after = to_time_point(X509_get0_notAfter(cert));
+        entry.not_before = std::max(entry.not_before, to_seconds(not_before));
+        entry.not_after = std::min(entry.not_after, to_seconds(not_after));
+      }
+      entry.anchor = sha256_digest(valid_chain.back().der());
+      auto key = make_key(kind, digest, did);
+
+      const std::lock_guard<std::mutex> lock(mutex);
+      if (const auto it = index.find(key); it != index.end())
+      {
+        entries.erase(it->second);
+        index.erase(it);
+      }
+      entries.emplace_front(std::move(key), std::move(entry));
+      index.emplace(entries.front().first, entries.begin());
+      while (entries.size() > max_entries)
+      {
+        index.erase(entries.back().first);
+        entries.pop_back();
+      }
+    }
+
+    const TrustBundle* anchors = nullptr;
+    const size_t max_entries;
+    const Limits limits;
+
+    mutable std::mutex mutex;
+    Entries entries;
+    std::unordered_map<std::string_view, Entries::iterator> index;
+    std::atomic<uint64_t> hits_count = 0;
+    std::atomic<uint64_t> misses_count = 0;
+  };
+
+  /// Options for warmup().
+  struct WarmupOptions
+  {
+    /// Resolve a small built-in chain (EC root, RSA intermediate, EC leaf)
+    /// with a DID that uses every policy kind, so that
+    /// the first real resolution finds all lazily initialised state ready.
+    bool sample_chain = true;
+
+    /// Load OpenSSL's error strings, which are otherwise loaded the first
+    /// time an error message is built.
+    bool error_strings = true;
+
+    /// Additional public key algorithms, by OpenSSL name (e.g. "ED25519",
+    /// "ML-DSA-65"), whose key management and signature implementations
+    /// are fetched ahead of time. Unknown names are ignored. Only has an
+    /// effect with OpenSSL 3.
+    std::vector<std::string> key_types = {};
+
+    /// Start default_thread_pool(), so that the first parallel or
+    /// asynchronous call does not pay for creating its workers.
+    bool default_thread_pool = false;
+  };
+
+  /// Prepares the calling thread's OpenSSL state. warmup() calls this for the
+  /// thread it runs on and ThreadPool workers call it when they start;
+  /// callers with threads of their own may call it from each of them.
+  inline void warmup_thread()
+  {
+    // Creates the thread-local error queue.
+    ERR_set_mark();
+    ERR_pop_to_mark();
+  }
+
+  /// An executor runs submitted tasks, typically on a thread pool owned by the
+  /// caller. All asynchronous and parallel work in the library is handed to an
+  /// executor; apart from ThreadPool below, the library never creates threads.
+  ///
+  /// Besides the required submit(), an executor may optionally provide
+  ///  - bulk_submit(std::vector<std::function<void()>>), to enqueue many tasks
+  ///    at once, and
+  ///  - concurrency(), a hint of how many tasks it runs in parallel.
+  template <typename E>
+  concept Executor = requires(E& e, std::function<void()> task) {
+    e.submit(std::move(task));
+  };
+
+  /// Submits all of `tasks`, in one call if the executor supports bulk
+  /// submission.
+  template <Executor E>
+  inline void bulk_submit(E& executor, std::vector<std::function<void()>> tasks)
+  {
+    if constexpr (requires { executor.bulk_submit(std::move(tasks)); })
+    {
+      executor.bulk_submit(std::move(tasks));
+    }
+    else
+    {
+      for (auto& task : tasks)
+      {
+        executor.submit(std::move(task));
+      }
+    }
+  }
+
+  /// Number of tasks the executor is expected to run in parallel. Executors
+  /// that do not provide a hint are assumed to use one thread per core.
+  template <Executor E>
+  inline size_t concurrency(const E& executor)
+  {
+    size_t r = 0;
+    if constexpr (requires {
+                    {
+                      executor.concurrency()
+                    } -> std::convertible_to<size_t>;
+                  })
+    {
+      r = executor.concurrency();
+    }
+    else
+    {
+      r = std::thread::hardware_concurrency();
+    }
+    return std::max<size_t>(r, 1);
+  }
+
+  /// Executor that runs every task immediately on the submitting thread.
+  class InlineExecutor
+  {
+  public:
+    void submit(std::function<void()> task)
+    {
+      task();
+    }
+
+    [[nodiscard]] size_t concurrency() const
+    {
+      return 1;
+    }
+  };
+
+  /// Work-stealing thread pool. Each worker has its own deque; tasks submitted
+  /// from a worker go to that worker's deque and are run LIFO, while idle
+  /// workers steal the oldest task from the other workers. Tasks submitted
+  /// from outside the pool are distributed round-robin. The destructor runs
+  /// all tasks that are still queued and then joins the workers.
+  class ThreadPool
+  {
+  public:
+    explicit ThreadPool(
+      size_t num_threads = std::thread::hardware_concurrency())
+    {
+      num_threads = std::max<size_t>(num_threads, 1);
+      for (size_t i = 0; i < num_threads; i++)
+      {
+        queues.push_back(std::make_unique<Queue>());
+      }
+      threads.reserve(num_threads);
+      for (size_t i = 0; i < num_threads; i++)
+      {
+        threads.emplace_back([this, i]() { run(i); });
+      }
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    ~ThreadPool()
+    {
+      {
+        const std::lock_guard<std::mutex> lock(sleep_mutex);
+        stopping = true;
+      }
+      wake.notify_all();
+      for (auto& t : threads)
+      {
+        t.join();
+      }
+    }
+
+    void submit(std::function<void()> task)
+    {
+      push(target_queue(), std::move(task));
+      notify(1);
+    }
+
+    void bulk_submit(std::vector<std::function<void()>> tasks)
+    {
+      const size_t first = target_queue();
+      for (size_t i = 0; i < tasks.size(); i++)
+      {
+        push((first + i) % queues.size(), std::move(tasks[i]));
+      }
+      notify(tasks.size());
+    }
+
+    [[nodiscard]] size_t concurrency() const
+    {
+      return threads.size();
+    }
+
+  private:
+    struct Queue
+    {
+      std::mutex mutex;
+      std::deque<std::function<void()>> tasks;
+    };
+
+    std::vector<std::unique_ptr<Queue>> queues;
+    std::vector<std::thread> threads;
+    std::atomic<size_t> next_queue{0};
+
+    // Number of tasks pushed but not yet popped. It is signed because a task
+    // can be popped before the submitter has incremented the counter.
+    std::atomic<std::ptrdiff_t> pending{0};
+    std::mutex sleep_mutex;
+    std::condition_variable wake;
+    bool stopping = false;
+
+    static inline thread_local const ThreadPool* current_pool = nullptr;
+    static inline thread_local size_t current_index = 0;
+
+    size_t target_queue()
+    {
+      if (current_pool == this)
+      {
+        return current_index;
+      }
+      return next_queue.fetch_add(1, std::memory_order_relaxed) %
+        queues.size();
+    }
+
+    void push(size_t i, std::function<void()> task)
+    {
+      const std::lock_guard<std::mutex> lock(queues[i]->mutex);
+      queues[i]->tasks.push_back(std::move(task));
+    }
+
+    void notify(size_t n)
+    {
+      pending.fetch_add(n);
+      {
+        // Taking the lock orders the increment above with a worker that is
+        // about to wait, so the wake-up cannot be lost.
+        const std::lock_guard<std::mutex> lock(sleep_mutex);
+      }
+      if (n == 1)
+      {
+        wake.notify_one();
+      }
+      else
+      {
+        wake.notify_all();
+      }
+    }
+
+    bool try_pop(size_t i, std::function<void()>& task)
+    {
+      // Own queue: newest first, for cache locality of nested work.
+      {
+        const std::lock_guard<std::mutex> lock(queues[i]->mutex);
+        if (!queues[i]->tasks.empty())
+        {
+          task = std::move(queues[i]->tasks.back());
+          queues[i]->tasks.pop_back();
+          return true;
+        }
+      }
+      // Other queues: steal the oldest task.
+      for (size_t k = 1; k < queues.size(); k++)
+      {
+        auto& q = *queues[(i + k) % queues.size()];
+        const std::lock_guard<std::mutex> lock(q.mutex);
+        if (!q.tasks.empty())
+        {
+          task = std::move(q.tasks.front());
+          q.tasks.pop_front();
+          return true;
+        }
+      }
+      return false;
+    }
+
+    void run(size_t i)
+    {
+      warmup_thread();
+      current_pool = this;
+      current_index = i;
+      for (;;)
+      {
+        std::function<void()> task;
+        if (try_pop(i, task))
+        {
+          pending.fetch_sub(1);
+          task();
+          continue;
+        }
+        std::unique_lock<std::mutex> lock(sleep_mutex);
+        wake.wait(lock, [this]() { return stopping || pending.load() > 0; });
+        if (stopping && pending.load() <= 0)
+        {
+          return;
+        }
+      }
+    }
+  };
+
+  /// Process-wide pool with one worker per core, created on first use, for
+  /// callers that do not bring an executor of their own.
+  inline ThreadPool& default_thread_pool()
+  {
+    static ThreadPool pool;
+    return pool;
+  }
+
+  namespace
+  {
+    // Leaf first. Valid until 2126; see WarmupOptions::sample_chain.
+    constexpr std::string_view warmup_chain_pem = R"(
+-----BEGIN CERTIFICATE-----
+MIICtDCCAZygAwIBAgIBAzANBgkqhkiG9w0BAQsFADApMScwJQYDVQQDDB5kaWR4
+NTA5Y3BwIHdhcm11cCBpbnRlcm1lZGlhdGUwIBcNMjYxMDE5MTIwMTA3WhgPMjEy
+NjA5MjUxMjAxMDdaMCExHzAdBgNVBAMMFmRpZHg1MDljcHAgd2FybXVwIGxlYWYw
+WTATBgcqhkjOPQIBBggqhkjOPQMBBwNCAATpdF5BBMznai+KMTZfSFRYnh0NQUng
+6eY0zuaCm5AK0c3yGuHdryAEDLUbYveyy+5k0PSQbhBZVC+2gndZctJto4G3MIG0
+MAwGA1UdEwEB/wQCMAAwDgYDVR0PAQH/BAQDAgeAMB0GA1UdDgQWBBRzrLzupZAl
+KdK/4KngGdBqPv3AFDAfBgNVHSMEGDAWgBTPccCVdpqdE4WQWFl2DQ+vsq18wjAZ
+BgNVHREEEjAQgg53YXJtdXAuZXhhbXBsZTATBgNVHSUEDDAKBggrBgEFBQcDAzAk
+BgorBgEEAYO/MAEBBBZodHRwczovL3dhcm11cC5leGFtcGxlMA0GCSqGSIb3DQEB
+CwUAA4IBAQCSaaSnJm+Zt+M5FAFWkY4u06IG0s8xcXSwNmndWyxfugQRm04SD5bk
+HJpkPrdm2z9jq4Tz9u9+rNDJ0oVAarb/VD6fmDow3cW/fTYrDibpAbvqFtE+Qmw7
+vev6+ESJFf3VuIhsqmTgGflYDZBIIoCPW9j9W2mR5Aie592SdVScmrJylyz0roaG
+ZvW2oT3v7e9rtB5VFjmTM8zlscrEJpnXHclUdD6CtFhThLUw2gdPziylaEXqiniw
+B3Uve4ITX725vDow6vigo6koSLq0Dm1uw2sDiPpI+udmS53ZK5wVJbd80Tve9lJk
+tXgyeE2Rw1plFtlGhLNuQF9bBChCMwWF
+-----END CERTIFICATE-----
+-----BEGIN CERTIFICATE-----
+MIICazCCAhKgAwIBAgIBAjAKBggqhkjOPQQDAjAhMR8wHQYDVQQDDBZkaWR4NTA5
+Y3BwIHdhcm11cCByb290MCAXDTI2MTAxOTEyMDEwN1oYDzIxMjYwOTI1MTIwMTA3
+WjApMScwJQYDVQQDDB5kaWR4NTA5Y3BwIHdhcm11cCBpbnRlcm1lZGlhdGUwggEi
+MA0GCSqGSIb3DQEBAQUAA4IBDwAwggEKAoIBAQC4no5pop8h8soecEPKE2dtx4Fo
+BQXb1ymP2dqko4FLWkYZRJWkSg2eU1pCUtH9tkv1zEZY2qrndloPEeP62ab+jmcP
+C5jdTnWbe6cpxpqrIpk0UFzM3v40Bw74cz+kDg9WbTIZVlzi2e1Rgo9vYmHAmaR/
+U5HR3TlfRU0KGRNGgsVrd/1RnVvWKnjpEuyDBkDmIfrxCPTPrsz1FFCdfUnmE2CB
+ATGgObSsgQsXyM7AZ4wgMKGH15ut/ebnK3MCsLU7YOVvUvXqstX1fg4P8a6EKGR+
+JifcnDm7MmL6YBTvmRY8eX5I98/WPRdnqduK7Efxzu0suIbc4IotsfOqTZ7VAgMB
+AAGjZjBkMBIGA1UdEwEB/wQIMAYBAf8CAQAwDgYDVR0PAQH/BAQDAgEGMB0GA1Ud
+DgQWBBTPccCVdpqdE4WQWFl2DQ+vsq18wjAfBgNVHSMEGDAWgBSqZtaAI+RP/PH6
+sVYghmXFs7nkQDAKBggqhkjOPQQDAgNHADBEAiBeAClqNXi8RU+74VxQYGcAI9Hg
+eLzFHkmM39owf+u89gIgRJGG/VnzFkbotsrRG6OMZin4cAK5RTvccNxNoAvR2hw=
+-----END CERTIFICATE-----
+-----BEGIN CERTIFICATE-----
+MIIBhzCCAS6gAwIBAgIUHggj7jtTZcI94TBsT35nsNJ2K4IwCgYIKoZIzj0EAwIw
+ITEfMB0GA1UEAwwWZGlkeDUwOWNwcCB3YXJtdXAgcm9vdDAgFw0yNjEwMTkxMjAx
+MDdaGA8yMTI2MDkyNTEyMDEwN1owITEfMB0GA1UEAwwWZGlkeDUwOWNwcCB3YXJt
+dXAgcm9vdDBZMBMGByqGSM49AgEGCCqGSM49AwEHA0IABF3py+3S9pISr8v0fNqN
+yWv2oB2ychsYmtvP1yoRc7HVmjQQIVmppbO6Ytexov7A7M2Ljh3ka1BtSetAyElp
+xXmjQjBAMA8GA1UdEwEB/wQFMAMBAf8wDgYDVR0PAQH/BAQDAgEGMB0GA1UdDgQW
+BBSqZtaAI+RP/PH6sVYghmXFs7nkQDAKBggqhkjOPQQDAgNHADBEAiAJsJGy642M
+EaWxeA6b5ioUIYw/Uo/ZVgapG1s5EvWmKwIgeVHcrGlacztWVqRbAX7ZiScyiT/p
+wpoG7ZCCgK5lA9Y=
+-----END CERTIFICATE-----
+)";
+
+    constexpr std::string_view warmup_did =
+      "did:x509:0:sha256:0q27_qVgSQb19VXLHjbRQ2__E-L0U5NsGd0oRRWFOJ8"
+      "::subject:CN:didx509cpp%20warmup%20leaf"
+      "::san:dns:warmup.example"
+      "::eku:1.3.6.1.5.5.7.3.3"
+      "::fulcio-issuer:warmup.example";
+  }
+
+  /// Performs the one-time initialisation that would otherwise be paid by
+  /// the first resolution in the process: OpenSSL library and error string
+  /// initialisation, digest and key algorithm fetches, JSON escaping
+  /// dispatch and, with `sample_chain`, everything touched by a full
+  /// resolution of a built-in chain. Safe to call more than once and from
+  /// several threads. With DIDX509CPP_INSTRUMENTATION, the sample
+  /// resolution is reported to the installed observer like any other.
+  inline void warmup(const WarmupOptions& options = {})
+  {
+    CHECK1(OPENSSL_init_crypto(
+      options.error_strings ? OPENSSL_INIT_LOAD_CRYPTO_STRINGS : 0, nullptr));
+    (void)Digests::get();
+    (void)json_scan_function();
+
+#if defined(OPENSSL_VERSION_MAJOR) && OPENSSL_VERSION_MAJOR >= 3
+    ERR_set_mark();
+    for (const auto& name : options.key_types)
+    {
+      EVP_KEYMGMT_free(EVP_KEYMGMT_fetch(nullptr, name.c_str(), nullptr));
+      EVP_SIGNATURE_free(EVP_SIGNATURE_fetch(nullptr, name.c_str(), nullptr));
+    }
+    ERR_pop_to_mark();
+#endif
+
+    if (options.sample_chain)
+    {
+      const std::string pem(warmup_chain_pem);
+      (void)resolve(pem, std::string(warmup_did), true);
+      // The leaf is EC; also build an RSA JWK from the intermediate.
+      const UqSTACK_OF_X509 chain(pem);
+      (void)chain.at(1).public_jwk();
+    }
+
+    if (options.default_thread_pool)
+    {
+      (void)default_thread_pool();
+    }
+
+    warmup_thread();
+  }
+
+  /// Calls f(i) for every i in [0, n) on up to concurrency(executor) tasks and
+  /// returns once all calls have completed. The calling thread takes part in
+  /// the work, so parallel_for makes progress even when every executor thread
+  /// is busy, and may itself be called from an executor task. If any call
+  /// throws, the remaining indices are still processed and the first
+  /// exception is rethrown at the end.
+  template <Executor E, typename F>
+  inline void parallel_for(E& executor, size_t n, F&& f)
+  {
+    struct State
+    {
+      std::atomic<size_t> next{0};
+      std::atomic<size_t> done{0};
+      std::mutex mutex;
+      std::condition_variable all_done;
+      std::exception_ptr error;
+    };
+    auto state = std::make_shared<State>();
+
+    // Helper tasks only touch `f` after claiming an index below n, and this
+    // function does not return before all such indices are done, so `f` is
+    // captured by reference. Helpers that start late find no work and only
+    // touch the shared state.
+    auto work = [state, n, &f]() {
+      for (;;)
+      {
+        const size_t i = state->next.fetch_add(1);
+        if (i >= n)
+        {
+          return;
+        }
+        try
+        {
+          f(i);
+        }
+        catch (...)
+        {
+          const std::lock_guard<std::mutex> lock(state->mutex);
+          if (!state->error)
+          {
+            state->error = std::current_exception();
+          }
+        }
+        if (state->done.fetch_add(1) + 1 == n)
+        {
+          const std::lock_guard<std::mutex> lock(state->mutex);
+          state->all_done.notify_all();
+        }
+      }
+    };
+
+    const size_t helpers = std::min(concurrency(executor), n);
+    if (helpers > 1)
+    {
+      std::vector<std::function<void()>> tasks(helpers - 1, work);
+      bulk_submit(executor, std::move(tasks));
+    }
+    work();
+
+    std::unique_lock<std::mutex> lock(state->mutex);
+    state->all_done.wait(lock, [&]() { return state->done.load() == n; });
+    if (state->error)
+    {
+      std::rethrow_exception(state->error);
+    }
+  }
+
+  /// Awaitable that runs `work` on an executor and resumes the awaiting
+  /// coroutine on the executor's thread once it has completed. The caller is
+  /// resumed directly from the task, so there is no second queue hop back to
+  /// the caller; a caller that needs to continue on its own event loop can
+  /// schedule itself there after the co_await.
+  template <Executor E, typename F>
+  class ExecutorAwaitable
+  {
+  public:
+    using result_type = std::invoke_result_t<F&>;
+
+    ExecutorAwaitable(E& executor, F work) :
+      executor(executor),
+      work(std::move(work))
+    {}
+
+    [[nodiscard]] bool await_ready() const noexcept
+    {
+      return false;
+    }
+
+    void await_suspend(std::coroutine_handle<> caller)
+    {
+      executor.submit([this, caller]() {
+        try
+        {
+          result.emplace(work());
+        }
+        catch (...)
+        {
+          error = std::current_exception();
+        }
+        caller.resume();
+      });
+    }
+
+    result_type await_resume()
+    {
+      if (error)
+      {
+        std::rethrow_exception(error);
+      }
+      return std::move(*result);
+    }
+
+  private:
+    E& executor;
+    F work;
+    std::optional<result_type> result;
+    std::exception_ptr error;
+  };
+
+  /// Asynchronous variant of resolve(). PEM parsing, chain verification,
+  /// fingerprinting and DID document rendering all run on `executor`; the
+  /// awaiting coroutine is resumed on the executor's thread with the DID
+  /// document, or with the exception resolve() would have thrown.
+  template <Executor E>
+  inline auto resolve_async(
+    E& executor,
+    std::string chain_pem,
+    std::string did,
+    bool ignore_time = false,
+    const Limits& limits = {})
+  {
+    auto work = [chain_pem = std::move(chain_pem),
+                 did = std::move(did),
+                 ignore_time,
+                 limits]() {
+      return resolve(chain_pem, did, ignore_time, limits);
+    };
+    return ExecutorAwaitable<E, decltype(work)>(executor, std::move(work));
+  }
+
+  /// Asynchronous variant of resolve_jwk(), see resolve_async().
+  template <Executor E>
+  inline auto resolve_jwk_async(
+    E& executor,
+    std::vector<std::string> chain_pem,
+    std::string did,
+    bool ignore_time = false,
+    const Limits& limits = {})
+  {
+    auto work = [chain_pem = std::move(chain_pem),
+                 did = std::move(did),
+                 ignore_time,
+                 limits]() {
+      return resolve_jwk(chain_pem, did, ignore_time, limits);
+    };
+    return ExecutorAwaitable<E, decltype(work)>(executor, std::move(work));
+  }
+
+  struct AuditRecord
+  {
+    std::string did;
+    /// Time at which the chain must have been valid.
+    std::chrono::system_clock::time_point time;
+  };
+
+  struct AuditResult
+  {
+    bool valid = false;
+    /// Why the record is not valid; empty if it is.
+    std::string error;
+  };
+
+  /// Checks, for each record, whether `chain` resolved `record.did` at
+  /// `record.time`, with the same semantics as resolve_chain(chain, did, at).
+  /// The chain is parsed once by the caller and all records share one trust
+  /// store, built from the chain's last certificate. Records are checked in
+  /// parallel on `executor`; results are in record order.
+  template <Executor E>
+  inline std::vector<AuditResult> audit(
+    const UqSTACK_OF_X509& chain,
+    const std::vector<AuditRecord>& records,
+    E& executor,
+    const Limits& limits = {})
+  {
+    std::vector<AuditResult> results(records.size());
+    if (chain.empty())
+    {
+      for (auto& result : results)
+      {
+        result.error = "no certificate chain";
+      }
+      return results;
+    }
+
+    std::vector<UqX509> roots;
+    roots.emplace_back(chain.back());
+    const auto store = UqSTACK_OF_X509::make_store(roots);
+
+    parallel_for(executor, records.size(), [&](size_t i) {
+      try
+      {
+        const auto valid_chain =
+          chain.verify(store, records[i].time, true, limits);
+        verify(valid_chain, records[i].did, limits);
+        results[i].valid = true;
+      }
+      catch (const std::exception& e)
+      {
+        results[i].error = e.what();
+      }
+    });
+    return results;
+  }
+
+  inline std::vector<AuditResult> audit(
+    const UqSTACK_OF_X509& chain,
+    const std::vector<AuditRecord>& records,
+    const Limits& limits = {})
+  {
+    InlineExecutor executor;
+    return audit(chain, records, executor, limits);
+  }
+
+#ifdef DIDX509CPP_INSTRUMENTATION
+  /// Observer that aggregates stage events into counters and log-linear
+  /// (HDR-style) latency histograms, exportable in the Prometheus text format
+  /// or as JSON. Install it with set_observer().
+  ///
+  /// Every thread records into its own shard, written only by that thread with
+  /// relaxed atomic stores, so recording takes no locks and causes no cache
+  /// line contention. Exporting sums all shards; it may run concurrently with
+  /// recording and then sees a slightly stale but consistent-enough view.
+  class Metrics : public Observer
+  {
+  public:
+    /// Histogram buckets: values below 16ns are exact, above that each power
+    /// of two is split into 8 linear sub-buckets (3 significant bits, at most
+    /// 12.5% relative error).
+    static constexpr size_t num_buckets = 16 + (64 - 4) * 8;
+
+    /// Distinct (stage, policy) combinations; policy stages are keyed by
+    /// policy type.
+    static constexpr size_t num_slots = 6 + 6;
+
+    /// X509_V_ERR_* codes at or above this value are counted together.
+    static constexpr int max_x509_error = 128;
+
+    struct Histogram
+    {
+      std::vector<uint64_t> buckets = std::vector<uint64_t>(num_buckets, 0);
+      uint64_t count = 0;
+      uint64_t sum_ns = 0;
+
+      /// Upper bound (in ns) of the bucket holding quantile q in [0, 1].
+      [[nodiscard]] uint64_t quantile(double q) const
+      {
+        if (count == 0)
+        {
+          return 0;
+        }
+        const auto rank = static_cast<uint64_t>(q * (double)(count - 1)) + 1;
+        uint64_t seen = 0;
+        for (size_t i = 0; i < buckets.size(); i++)
+        {
+          seen += buckets[i];
+          if (seen >= rank)
+          {
+            return bucket_upper(i);
+          }
+        }
+        return bucket_upper(buckets.size() - 1);
+      }
+    };
+
+    Metrics() = default;
+    Metrics(const Metrics&) = delete;
+    Metrics& operator=(const Metrics&) = delete;
+
+    void on_stage_end(const StageEvent& event) override
+    {
+      auto& shard = local_shard();
+      const auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                        event.end - event.begin)
+                        .count();
+      auto& slot = shard.slots[slot_of(event.stage, event.policy)];
+      bump(event.success ? slot.success : slot.failure);
+      bump(slot.sum_ns, ns > 0 ? static_cast<uint64_t>(ns) : 0);
+      bump(slot.buckets[bucket_of(ns > 0 ? static_cast<uint64_t>(ns) : 0)]);
+      if (!event.success)
+      {
+        bump(shard.errors[static_cast<size_t>(event.error)]);
+        if (event.error == ErrorCategory::chain_verification)
+        {
+          bump(shard.x509_errors[std::clamp(
+            event.x509_error, 0, max_x509_error)]);
+        }
+      }
+    }
+
+    /// Number of completed (stage, policy) events with the given outcome.
+    [[nodiscard]] uint64_t count(
+      Stage stage, PolicyType policy = PolicyType::none, bool success = true)
+      const
+    {
+      return sum([&](const Shard& shard) {
+        const auto& slot = shard.slots[slot_of(stage, policy)];
+        return (success ? slot.success : slot.failure)
+          .load(std::memory_order_relaxed);
+      });
+    }
+
+    /// Number of failed stages with the given error category.
+    [[nodiscard]] uint64_t errors(ErrorCategory error) const
+    {
+      return sum([&](const Shard& shard) {
+        return shard.errors[static_cast<size_t>(error)].load(
+          std::memory_order_relaxed);
+      });
+    }
+
+    /// Number of chain verification failures with the given X509_V_ERR_*
+    /// code.
+    [[nodiscard]] uint64_t x509_errors(int code) const
+    {
+      return sum([&](const Shard& shard) {
+        return shard.x509_errors[std::clamp(code, 0, max_x509_error)].load(
+          std::memory_order_relaxed);
+      });
+    }
+
+    /// Latency histogram of a (stage, policy) combination, over successful
+    /// and failed events.
+    [[nodiscard]] Histogram latency(
+      Stage stage, PolicyType policy = PolicyType::none) const
+    {
+      Histogram r;
+      const std::lock_guard<std::mutex> lock(shards->mutex);
+      for (const auto& shard : shards->shards)
+      {
+        const auto& slot = shard->slots[slot_of(stage, policy)];
+        r.count += slot.success.load(std::memory_order_relaxed) +
+          slot.failure.load(std::memory_order_relaxed);
+        r.sum_ns += slot.sum_ns.load(std::memory_order_relaxed);
+        for (size_t i = 0; i < num_buckets; i++)
+        {
+          r.buckets[i] += slot.buckets[i].load(std::memory_order_relaxed);
+        }
+      }
+      return r;
+    }
+
+    /// Number of per-thread shards currently allocated. Shards of threads
+    /// that have exited are folded into a single shard, so this tracks the
+    /// number of live reporting threads.
+    [[nodiscard]] size_t shard_count() const
+    {
+      const std::lock_guard<std::mutex> lock(shards->mutex);
+      return shards->shards.size();
+    }
+
+    /// Prometheus text exposition format (version 0.0.4).
+    [[nodiscard]] std::string prometheus() const
+    {
+      // Exported bucket boundaries, in ns. Each internal bucket is counted
+      // under the first boundary at or above its upper bound.
+      static constexpr uint64_t bounds[] = {
+        1'000,       2'500,       5'000,       10'000,      25'000,
+        50'000,      100'000,     250'000,     500'000,     1'000'000,
+        2'500'000,   5'000'000,   10'000'000,  25'000'000,  50'000'000,
+        100'000'000, 250'000'000, 500'000'000, 1'000'000'000};
+
+      std::string r;
+      r += "# HELP didx509_stage_total Completed resolution stages.\n";
+      r += "# TYPE didx509_stage_total counter\n";
+      for_each_slot([&](Stage stage, PolicyType policy) {
+        for (const bool success : {true, false})
+        {
+          r += "didx509_stage_total{" + labels(stage, policy) +
+            ",outcome=\"" + (success ? "success" : "failure") + "\"} " +
+            std::to_string(count(stage, policy, success)) + "\n";
+        }
+      });
+
+      r += "# HELP didx509_stage_duration_seconds Duration of resolution "
+           "stages.\n";
+      r += "# TYPE didx509_stage_duration_seconds histogram\n";
+      for_each_slot([&](Stage stage, PolicyType policy) {
+        const auto h = latency(stage, policy);
+        const auto prefix =
+          "didx509_stage_duration_seconds_bucket{" + labels(stage, policy);
+        uint64_t cumulative = 0;
+        size_t b = 0;
+        for (const auto bound : bounds)
+        {
+          while (b < num_buckets && bucket_upper(b) <= bound)
+          {
+            cumulative += h.buckets[b++];
+          }
+          r += prefix + ",le=\"" + seconds(bound) + "\"} " +
+            std::to_string(cumulative) + "\n";
+        }
+        r += prefix + ",le=\"+Inf\"} " + std::to_string(h.count) + "\n";
+        r += "didx509_stage_duration_seconds_sum{" + labels(stage, policy) +
+          "} " + seconds(h.sum_ns) + "\n";
+        r += "didx509_stage_duration_seconds_count{" + labels(stage, policy) +
+          "} " + std::to_string(h.count) + "\n";
+      });
+
+      r += "# HELP didx509_errors_total Failed stages by error category.\n";
+      r += "# TYPE didx509_errors_total counter\n";
+      for (size_t e = 1; e < num_errors; e++)
+      {
+        r += std::string("didx509_errors_total{category=\"") +
+          to_string(static_cast<ErrorCategory>(e)) + "\"} " +
+          std::to_string(errors(static_cast<ErrorCategory>(e))) + "\n";
+      }
+
+      r += "# HELP didx509_chain_verification_errors_total Chain verification "
+           "failures by X509_V_ERR code.\n";
+      r += "# TYPE didx509_chain_verification_errors_total counter\n";
+      for (int code = 0; code <= max_x509_error; code++)
+      {
+        const auto n = x509_errors(code);
+        if (n != 0)
+        {
+          r += "didx509_chain_verification_errors_total{code=\"" +
+            std::to_string(code) + "\"} " + std::to_string(n) + "\n";
+        }
+      }
+      return r;
+    }
+
+    /// JSON summary with counters and latency quantiles (in ns).
+    [[nodiscard]] std::string json() const
+    {
+      std::string r = R"({"stages":[)";
+      bool first = true;
+      for_each_slot([&](Stage stage, PolicyType policy) {
+        const auto h = latency(stage, policy);
+        r += first ? "" : ",";
+        first = false;
+        r += std::string(R"({"stage":")") + to_string(stage) + R"(")";
+        if (stage == Stage::policy)
+        {
+          r += std::string(R"(,"policy":")") + to_string(policy) + R"(")";
+        }
+        r += R"(,"success":)" + std::to_string(count(stage, policy, true));
+        r += R"(,"failure":)" + std::to_string(count(stage, policy, false));
+        r += R"(,"sum_ns":)" + std::to_string(h.sum_ns);
+        r += R"(,"p50_ns":)" + std::to_string(h.quantile(0.5));
+        r += R"(,"p90_ns":)" + std::to_string(h.quantile(0.9));
+        r += R"(,"p99_ns":)" + std::to_string(h.quantile(0.99));
+        r += R"(,"max_ns":)" + std::to_string(h.quantile(1.0)) + "}";
+      });
+      r += R"(],"errors":{)";
+      for (size_t e = 1; e < num_errors; e++)
+      {
+        r += std::string(e == 1 ? "" : ",") + "\"" +
+          to_string(static_cast<ErrorCategory>(e)) +
+          "\":" + std::to_string(errors(static_cast<ErrorCategory>(e)));
+      }
+      r += R"(},"x509_errors":{)";
+      first = true;
+      for (int code = 0; code <= max_x509_error; code++)
+      {
+        const auto n = x509_errors(code);
+        if (n != 0)
+        {
+          r += std::string(first ? "" : ",") + "\"" + std::to_string(code) +
+            "\":" + std::to_string(n);
+          first = false;
+        }
+      }
+      r += "}}";
+      return r;
+    }
+
+    static size_t bucket_of(uint64_t ns)
+    {
+      if (ns < 16)
+      {
+        return ns;
+      }
+      const int e = 63 - std::countl_zero(ns);
+      const uint64_t m = ns >> (e - 3);
+      return 16 + (e - 4) * 8 + (m - 8);
+    }
+
+    static uint64_t bucket_upper(size_t i)
+    {
+      if (i < 16)
+      {
+        return i;
+      }
+      const size_t e = 4 + (i - 16) / 8;
+      const uint64_t m = 8 + (i - 16) % 8;
+      if (e == 63 && m == 15)
+      {
+        return std::numeric_limits<uint64_t>::max();
+      }
+      return ((m + 1) << (e - 3)) - 1;
+    }
+
+  private:
+    static constexpr size_t num_errors =
+      static_cast<size_t>(ErrorCategory::other) + 1;
+
+    struct Slot
+    {
+      std::atomic<uint64_t> success{0};
+      std::atomic<uint64_t> failure{0};
+      std::atomic<uint64_t> sum_ns{0};
+      std::atomic<uint64_t> buckets[num_buckets] = {};
+    };
+
+    struct Shard
+    {
+      Slot slots[num_slots];
+      std::atomic<uint64_t> errors[num_errors] = {};
+      std::atomic<uint64_t> x509_errors[max_x509_error + 1] = {};
+    };
+
+    // Shards of live threads, preceded by one holding the counts of threads
+    // that have exited. Shared with the threads' exit guards, which may run
+    // after the Metrics instance is gone.
+    struct Shards
+    {
+      std::mutex mutex;
+      std::vector<std::unique_ptr<Shard>> shards;
+
+      Shards()
+      {
+        shards.push_back(std::make_unique<Shard>());
+      }
+
+      // Folds a thread's shard into the retired shard and frees it.
+      void retire(Shard* shard)
+      {
+        const std::lock_guard<std::mutex> lock(mutex);
+        const auto it = std::ranges::find_if(
+          shards, [shard](const auto& s) { return s.get() == shard; });
+        if (it == shards.end())
+        {
+          return;
+        }
+        merge(*shards.front(), *shard);
+        shards.erase(it);
+      }
+    };
+
+    // A thread's shards in each Metrics instance it reported to. On thread
+    // exit, the shards of instances that still exist are retired.
+    struct ThreadShards
+    {
+      struct Entry
+      {
+        uint64_t id;
+        std::weak_ptr<Shards> owner;
+        Shard* shard;
+      };
+      std::vector<Entry> entries;
+
+      ThreadShards() = default;
+      ThreadShards(const ThreadShards&) = delete;
+      ThreadShards& operator=(const ThreadShards&) = delete;
+
+      ~ThreadShards()
+      {
+        for (const auto& entry : entries)
+        {
+          if (const auto owner = entry.owner.lock())
+          {
+            owner->retire(entry.shard);
+          }
+        }
+      }
+    };
+
+    static inline std::atomic<uint64_t> next_id{0};
+    const uint64_t id = next_id.fetch_add(1);
+    const std::shared_ptr<Shards> shards = std::make_shared<Shards>();
+
+    // Only the owning thread writes a shard, so a plain load/store pair
+    // suffices and avoids a locked read-modify-write. The retired shard is
+    // written under Shards::mutex.
+    static void bump(std::atomic<uint64_t>& counter, uint64_t n = 1)
+    {
+      counter.store(
+        counter.load(std::memory_order_relaxed) + n,
+        std::memory_order_relaxed);
+    }
+
+    static void merge(Shard& into, const Shard& from)
+    {
+      const auto add = [](std::atomic<uint64_t>& to,
+                          const std::atomic<uint64_t>& value) {
+        bump(to, value.load(std::memory_order_relaxed));
+      };
+      for (size_t i = 0; i < num_slots; i++)
+      {
+        add(into.slots[i].success, from.slots[i].success);
+        add(into.slots[i].failure, from.slots[i].failure);
+        add(into.slots[i].sum_ns, from.slots[i].sum_ns);
+        for (size_t b = 0; b < num_buckets; b++)
+        {
+          add(into.slots[i].buckets[b], from.slots[i].buckets[b]);
+        }
+      }
+      for (size_t e = 0; e < num_errors; e++)
+      {
+        add(into.errors[e], from.errors[e]);
+      }
+      for (size_t c = 0; c <= max_x509_error; c++)
+      {
+        add(into.x509_errors[c], from.x509_errors[c]);
+      }
+    }
+
+    static size_t slot_of(Stage stage, PolicyType policy)
+    {
+      if (stage == Stage::policy)
+      {
+        return 6 + static_cast<size_t>(policy);
+      }
+      return static_cast<size_t>(stage);
+    }
+
+    template <typename F>
+    static void for_each_slot(F&& f)
+    {
+      for (const auto stage :
+           {Stage::parse_pem,
+            Stage::verify_chain,
+            Stage::check_fingerprint,
+            Stage::public_jwk,
+            Stage::create_did_document})
+      {
+        f(stage, PolicyType::none);
+      }
+      for (const auto policy :
+           {PolicyType::subject,
+            PolicyType::san,
+            PolicyType::eku,
+            PolicyType::fulcio_issuer,
+            PolicyType::unknown})
+      {
+        f(Stage::policy, policy);
+      }
+    }
+
+    static std::string labels(Stage stage, PolicyType policy)
+    {
+      std::string r = std::string("stage=\"") + to_string(stage) + "\"";
+      if (stage == Stage::policy)
+      {
+        r += std::string(",policy=\"") + to_string(policy) + "\"";
+      }
+      return r;
+    }
+
+    static std::string seconds(uint64_t ns)
+    {
+      const auto s = std::to_string(ns / 1'000'000'000);
+      auto frac = std::to_string(ns % 1'000'000'000);
+      frac.insert(0, 9 - frac.size(), '0');
+      while (!frac.empty() && frac.back() == '0')
+      {
+        frac.pop_back();
+      }
+      return frac.empty() ? s : s + "." + frac;
+    }
+
+    template <typename F>
+    uint64_t sum(F&& f) const
+    {
+      uint64_t r = 0;
+      const std::lock_guard<std::mutex> lock(shards->mutex);
+      for (const auto& shard : shards->shards)
+      {
+        r += f(*shard);
+      }
+      return r;
+    }
+
+    Shard& local_shard()
+    {
+      // Per-thread cache of this thread's shard in each Metrics instance,
+      // keyed by instance id so that a destroyed instance's entry can never
+      // be picked up by a new instance at the same address. Only the first
+      // event of a thread takes the lock.
+      thread_local ThreadShards cache;
+      for (const auto& entry : cache.entries)
+      {
+        if (entry.id == id)
+        {
+          return *entry.shard;
+        }
+      }
+      std::erase_if(cache.entries, [](const ThreadShards::Entry& entry) {
+        return entry.owner.expired();
+      });
+      auto shard = std::make_unique<Shard>();
+      Shard* r = shard.get();
+      {
+        const std::lock_guard<std::mutex> lock(shards->mutex);
+        shards->shards.push_back(std::move(shard));
+      }
+      cache.entries.push_back({id, shards, r});
+      return *r;
+    }
+  };
+#endif
 }